@@ -0,0 +1,95 @@
+// Arena.cpp - Arena regions tracked independently in one frame
+#include "Arena.h"
+
+// std
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Reads an arena config file, see ArenaConfig.
+ *
+ * args: fileName
+ *		 defaultThreshold: threshold of arenas that don't specify one
+ * returns: arenas in file order
+ * throws: runtime_error iff the file can't be read or a line is malformed
+ */
+vector<ArenaConfig> loadArenaConfig(string fileName, int defaultThreshold) {
+	ifstream in(fileName);
+	if (!in.is_open())
+		throw runtime_error("Can't open arena config file \"" + fileName + "\"");
+
+	vector<ArenaConfig> arenas;
+	string line;
+	int lineNr = 0;
+	while (getline(in, line)) {
+		lineNr++;
+		istringstream fields(line);
+		ArenaConfig arena;
+		if (!(fields >> arena.name) || arena.name[0] == '#')
+			continue; // Empty or comment
+
+		int x, y, width, height;
+		if (!(fields >> x >> y >> width >> height) || width <= 0 || height <= 0)
+			throw runtime_error(fileName + ":" + to_string(lineNr) + ": expected name x y width height [threshold] [datafile]");
+		arena.region = Rect(x, y, width, height);
+
+		if (!(fields >> arena.thresholdValue))
+			arena.thresholdValue = defaultThreshold;
+		if (!(fields >> arena.dataFileName))
+			arena.dataFileName = arena.name + ".csv";
+		arena.bgFileName = "bg_" + arena.name + ".bmp";
+
+		arenas.push_back(arena);
+	}
+
+	if (arenas.empty())
+		throw runtime_error("Arena config file \"" + fileName + "\" doesn't contain any arenas");
+
+	return arenas;
+}
+
+/**
+ * returns: smallest rectangle containing all arenas, the only part
+ *			of the sensor frame that has to be converted
+ */
+Rect arenaBounds(const vector<ArenaConfig>& arenas) {
+	Rect bounds = arenas[0].region;
+	for (const ArenaConfig& arena : arenas)
+		bounds |= arena.region;
+	return bounds;
+}
+
+/**
+ * Reads a crop rectangle, either given directly as x,y,width,height or
+ * as the name of a file whose first non-comment line is x y width height.
+ *
+ * args: spec
+ * returns: crop in sensor (uncropped) frame coordinates
+ * throws: runtime_error iff it's neither
+ */
+Rect parseCrop(string spec) {
+	string fields = spec;
+	if (count(spec.begin(), spec.end(), ',') != 3) {
+		ifstream in(spec);
+		if (!in.is_open())
+			throw runtime_error("Crop \"" + spec + "\" is neither x,y,width,height nor a readable file");
+		while (getline(in, fields) && (fields.empty() || fields[0] == '#'))
+			;
+	}
+	replace(fields.begin(), fields.end(), ',', ' ');
+
+	istringstream in(fields);
+	int x, y, width, height;
+	if (!(in >> x >> y >> width >> height) || width <= 0 || height <= 0)
+		throw runtime_error("Crop \"" + spec + "\": expected x y width height");
+	return Rect(x, y, width, height);
+}
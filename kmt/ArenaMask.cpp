@@ -0,0 +1,114 @@
+// ArenaMask.cpp - Region of the frame inside the arena, as row spans
+#include "ArenaMask.h"
+
+// std
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+
+// Minimum fraction of the background the detected arena has to cover
+static const double minArenaFraction = 0.1;
+
+// Hull area / enclosing circle area above which the arena is a circle
+static const double minCircularity = 0.9;
+
+ArenaMask::ArenaMask() {}
+
+/**
+ * args: mask: CV_8U, non-zero inside the arena
+ */
+ArenaMask::ArenaMask(Mat mask) : frameSize(mask.size()), rows(mask.rows) {
+	for (int y = 0; y < mask.rows; y++) {
+		const tByte* row = mask.ptr<tByte>(y);
+		for (int x = 0; x < mask.cols; x++) {
+			if (!row[x]) continue;
+			int begin = x;
+			while (x < mask.cols && row[x])
+				x++;
+			rows[y].push_back({ begin, x });
+			Rect span(begin, y, x - begin, 1);
+			boundingBox = boundingBox.area() == 0 ? span : boundingBox | span;
+		}
+	}
+}
+
+bool ArenaMask::empty() const {
+	return rows.empty();
+}
+
+Size ArenaMask::size() const {
+	return frameSize;
+}
+
+/**
+ * returns: bounding box of the arena
+ */
+Rect ArenaMask::bounds() const {
+	return boundingBox;
+}
+
+/**
+ * returns: spans of row y, ordered, empty outside the arena
+ */
+const vector<RowSpan>& ArenaMask::row(int y) const {
+	return rows[y];
+}
+
+/**
+ * Finds the arena in a background: the floor and the walls separate
+ * with an Otsu threshold, the arena is the (convex hull of the) region
+ * at the center of the frame. Stored as a filled circle when it is
+ * close to one, else as a polygon.
+ *
+ * args: bg: CV_8U
+ * returns: mask, 255 inside the arena
+ * throws: runtime_error iff no sufficiently large arena is found
+ */
+Mat ArenaMask::detect(Mat bg) {
+	Mat binary;
+	threshold(bg, binary, 0, 255, THRESH_BINARY | THRESH_OTSU);
+
+	// The floor is whichever side of the threshold the center is on
+	Point center(bg.cols / 2, bg.rows / 2);
+	if (binary.at<tByte>(center) == 0)
+		bitwise_not(binary, binary);
+
+	vector<vector<Point>> contours;
+	findContours(binary, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+
+	int arena = -1;
+	double arenaArea = 0;
+	for (int i = 0; i < contours.size(); i++) {
+		double area = contourArea(contours[i]);
+		if (area > arenaArea && pointPolygonTest(contours[i], Point2f(center), false) >= 0) {
+			arena = i;
+			arenaArea = area;
+		}
+	}
+	if (arena < 0 || arenaArea < minArenaFraction * bg.total())
+		throw runtime_error("No arena found in the background");
+
+	vector<Point> hull;
+	convexHull(contours[arena], hull);
+
+	Mat mask = Mat::zeros(bg.size(), CV_8U);
+	Point2f circleCenter;
+	float radius;
+	minEnclosingCircle(hull, circleCenter, radius);
+	if (contourArea(hull) > minCircularity * CV_PI * radius * radius) {
+		circle(mask, circleCenter, (int)radius, Scalar(255), FILLED);
+	} else {
+		vector<Point> polygon;
+		approxPolyDP(hull, polygon, 2, true);
+		fillConvexPoly(mask, polygon, Scalar(255));
+	}
+
+	return mask;
+}
@@ -0,0 +1,217 @@
+// AsyncVideoWriter.cpp - Video encoding on a dedicated thread
+#include "AsyncVideoWriter.h"
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "CsvWriter.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * args: fileName
+ *		 fourcc: codec
+ *		 fps
+ *		 size, type: of the frames, every slot is allocated up front
+ *		 queueSize: frames waiting for the encoder at most
+ *		 policy: when the queue is full
+ *		 indexFileName: frame index to write, empty for none
+ * throws: runtime_error iff the video, index or spill file can't be created
+ */
+AsyncVideoWriter::AsyncVideoWriter(string fileName, int fourcc, double fps, Size size, int type, int queueSize, QueuePolicy policy, string indexFileName)
+	: writer(fileName, fourcc, fps, size, CV_MAT_CN(type) > 1), fps(fps), policy(policy), slots(std::max(queueSize, 1)) {
+	if (!writer.isOpened())
+		throw runtime_error("Can't create video file \"" + fileName + "\"");
+
+	for (Slot& slot : slots)
+		slot.frame.create(size, type);
+
+	if (!indexFileName.empty())
+		index.reset(new CsvWriter(indexFileName, { { "frame", 1 }, { "row", 1 }, { "t (ms)", 1 } }));
+
+	if (policy == spillPolicy) {
+		spillFileName = fileName + ".spill";
+		spillOut.open(spillFileName, ios::binary | ios::trunc);
+		spillIn.open(spillFileName, ios::binary);
+		if (!spillOut.is_open() || !spillIn.is_open())
+			throw runtime_error("Can't create spill file \"" + spillFileName + "\"");
+	}
+
+	encoder = thread(&AsyncVideoWriter::encodeLoop, this);
+}
+
+AsyncVideoWriter::~AsyncVideoWriter() {
+	close();
+}
+
+/**
+ * Queues a frame, of the size and type given at construction, for the
+ * output frames nearest to its capture time.
+ *
+ * args: frame: not modified afterwards, it's copied on the encoder thread
+ *		 t: time of capture (ms), the first frame starts the video
+ *		 row: data row of the frame, for the index
+ */
+void AsyncVideoWriter::write(Mat frame, unsigned t, unsigned row) {
+	write([frame](Mat& out) { frame.copyTo(out); }, t, row);
+}
+
+/**
+ * Queues a frame drawn by render(), see write(Mat, ...).
+ *
+ * args: render: draws the frame into its argument, only called when
+ *				 the frame is encoded (not when it's skipped or dropped)
+ *		 t, row
+ */
+void AsyncVideoWriter::write(function<void(Mat&)> render, unsigned t, unsigned row) {
+	unique_lock<mutex> lock(queueMutex);
+	if (stopping) return;
+
+	if (placed == 0) firstT = t;
+	int64_t due = (int64_t)floor((t - firstT) * fps / 1000 + 0.5) + 1;
+	int repeat = (int)(due - (int64_t)placed);
+	if (repeat <= 0) {
+		statistics.skipped++;
+		return;
+	}
+
+	// Once spilling, keep spilling until the encoder caught up, keeps the order
+	bool spilling = spillHead < spillQueued.size();
+	if (count == slots.size() || spilling) {
+		if (policy == dropPolicy) {
+			statistics.dropped++;
+			return;
+		}
+		if (policy == spillPolicy) {
+			Mat frame(slots[0].frame.size(), slots[0].frame.type());
+			render(frame);
+			spillOut.write(reinterpret_cast<const char*>(frame.data), frame.total() * frame.elemSize());
+			spillOut.flush();
+			spillQueued.push_back({ Clock::now(), repeat });
+			statistics.spilled++;
+		} else {
+			queueChanged.wait(lock, [this]() { return count < slots.size(); });
+		}
+	}
+
+	if (policy != spillPolicy || spillQueued.size() == spillHead) {
+		Slot& slot = slots[(head + count) % slots.size()];
+		slot.render = move(render);
+		slot.queued = { Clock::now(), repeat };
+		count++;
+	}
+
+	if (index) {
+		for (int k = 0; k < repeat; k++)
+			index->write({ (double)(placed + k), (double)row, (double)t });
+	}
+	placed += repeat;
+	statistics.repeated += repeat - 1;
+
+	statistics.depth = (int)(count + spillQueued.size() - spillHead);
+	statistics.maxDepth = std::max(statistics.maxDepth, statistics.depth);
+	queueChanged.notify_all();
+}
+
+/**
+ * Encodes the queued frames and closes the video, further frames are
+ * ignored.
+ */
+void AsyncVideoWriter::close() {
+	{
+		lock_guard<mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueChanged.notify_all();
+	if (!encoder.joinable()) return;
+	encoder.join();
+
+	writer.release();
+	if (index) index->close();
+	if (!spillFileName.empty()) {
+		spillOut.close();
+		spillIn.close();
+		remove(spillFileName.c_str());
+	}
+}
+
+VideoStats AsyncVideoWriter::stats() {
+	lock_guard<mutex> lock(queueMutex);
+	return statistics;
+}
+
+/**
+ * Encoder thread: the ring first, then spilled frames (all queued
+ * after the ring's), until stopped and empty.
+ */
+void AsyncVideoWriter::encodeLoop() {
+	Mat spilled(slots[0].frame.size(), slots[0].frame.type());
+	unique_lock<mutex> lock(queueMutex);
+	while (true) {
+		queueChanged.wait(lock, [this]() { return count > 0 || spillHead < spillQueued.size() || stopping; });
+
+		Queued queued;
+		bool fromRing = count > 0;
+		if (fromRing)
+			queued = slots[head].queued;
+		else if (spillHead < spillQueued.size())
+			queued = spillQueued[spillHead];
+		else
+			return; // Stopping and empty
+
+		// The slot stays taken while it's encoded, the spill file is only read here
+		lock.unlock();
+		Mat frame = fromRing ? slots[head].frame : spilled;
+		if (fromRing)
+			slots[head].render(frame);
+		else
+			spillIn.read(reinterpret_cast<char*>(spilled.data), spilled.total() * spilled.elemSize());
+		for (int k = 0; k < queued.repeat; k++)
+			writer.write(frame);
+		Clock::time_point done = Clock::now();
+		lock.lock();
+
+		if (fromRing) {
+			slots[head].render = nullptr; // Releases what it references
+			head = (head + 1) % slots.size();
+			count--;
+		} else {
+			spillHead++;
+		}
+
+		double latency = chrono::duration<double, milli>(done - queued.time).count();
+		statistics.frames += queued.repeat;
+		totalLatency += latency;
+		statistics.meanLatency = totalLatency / ++encoded;
+		statistics.maxLatency = std::max(statistics.maxLatency, latency);
+		statistics.depth = (int)(count + spillQueued.size() - spillHead);
+		queueChanged.notify_all();
+	}
+}
+
+/**
+ * returns: policy named block, drop or spill
+ * throws: invalid_argument iff the name is none of these
+ */
+QueuePolicy parseQueuePolicy(string name) {
+	if (name == "block") return blockPolicy;
+	if (name == "drop") return dropPolicy;
+	if (name == "spill") return spillPolicy;
+	throw invalid_argument("Unknown video queue policy \"" + name + "\", use block, drop or spill");
+}
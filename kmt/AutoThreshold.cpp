@@ -0,0 +1,89 @@
+// AutoThreshold.cpp - Threshold selection from the background difference histogram
+#include "AutoThreshold.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+// Bins, one per 8-bit difference
+static const int bins = 256;
+
+// Weight of the running histogram kept per frame, ~100 frame memory
+static const double decayFactor = 0.99;
+
+// Counted differences before the first selection
+static const double minSamples = 100000;
+
+/**
+ * args: initial: threshold until there are enough samples
+ *		 hysteresis: minimum change of the threshold
+ *		 minThreshold: lower bound of the threshold
+ */
+AutoThreshold::AutoThreshold(int initial, int hysteresis, int minThreshold)
+	: current(initial), hysteresis(hysteresis), minThreshold(minThreshold), frameHist(bins, 0), running(bins, 0) {}
+
+/**
+ * returns: 256 bins for the diff kernel to count the current frame in
+ */
+unsigned int* AutoThreshold::frameHistogram() {
+	return frameHist.data();
+}
+
+/**
+ * Adds the current frame's counts to the running histogram and
+ * reselects the threshold.
+ *
+ * returns: true iff the threshold changed
+ */
+bool AutoThreshold::update() {
+	double total = 0;
+	for (int i = 0; i < bins; i++) {
+		running[i] = running[i] * decayFactor + frameHist[i];
+		total += running[i];
+	}
+	fill(frameHist.begin(), frameHist.end(), 0);
+
+	if (total < minSamples)
+		return false;
+
+	int selected = select();
+	if (abs(selected - current) <= hysteresis)
+		return false;
+
+	current = selected;
+	return true;
+}
+
+int AutoThreshold::threshold() const {
+	return current;
+}
+
+/**
+ * Triangle method: the bin furthest below the line from the noise peak
+ * to the end of the tail.
+ */
+int AutoThreshold::select() const {
+	int peak = (int)(max_element(running.begin(), running.end()) - running.begin());
+	int end = bins - 1;
+	while (end > peak && running[end] < 1)
+		end--;
+	if (end - peak < 2)
+		return max(current, minThreshold); // No tail, nothing to separate
+
+	// Distance to the line up to a constant factor
+	double dx = end - peak;
+	double dy = running[end] - running[peak];
+	int best = peak;
+	double bestDist = 0;
+	for (int i = peak + 1; i < end; i++) {
+		double dist = dy * (i - peak) - dx * (running[i] - running[peak]); // Positive below the line
+		if (dist > bestDist) {
+			bestDist = dist;
+			best = i;
+		}
+	}
+
+	return max(best, minThreshold);
+}
@@ -0,0 +1,155 @@
+// BackgroundModel.cpp - Adaptive (running average) background
+#include "BackgroundModel.h"
+
+// std
+#include <atomic>
+#include <mutex>
+#include <thread>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+using tWord = unsigned short;
+
+// Fraction of changed pixels that counts as a global scene change
+static const double sceneChangeFraction = 0.3;
+
+// Consecutive updates with a scene change before relearning
+static const int sceneChangeUpdates = 3;
+
+/**
+ * args: initial: (blurred) background to start from
+ *		 blurSize: blur applied to frames before learning, as for tracking
+ *		 thresholdValue: pixels that differ more from the background aren't learned
+ *		 learningShift: learning rate is 1 / 2^learningShift per update
+ *		 updateInterval: learn from every n-th posted frame
+ */
+BackgroundModel::BackgroundModel(Mat initial, int blurSize, int thresholdValue, int learningShift, int updateInterval)
+	: blurSize(blurSize), thresholdValue(thresholdValue), learningShift(learningShift), updateInterval(updateInterval), front(0), pinned(-1) {
+	initial.convertTo(accumulator, CV_16U, 256);
+	buffers[0] = initial.clone();
+	buffers[1] = initial.clone();
+
+	worker = thread(&BackgroundModel::work, this);
+}
+
+BackgroundModel::~BackgroundModel() {
+	{
+		lock_guard<mutex> lock(jobMutex);
+		stopping = true;
+	}
+	jobPosted.notify_one();
+	worker.join();
+}
+
+/**
+ * Pins and returns the current background, never blocks.
+ *
+ * post: release() is called when done with it
+ */
+Mat BackgroundModel::acquire() {
+	int i;
+	do {
+		i = front.load();
+		pinned.store(i);
+	} while (front.load() != i); // Swapped in between, the worker may already be writing it
+
+	return buffers[i];
+}
+
+void BackgroundModel::release() {
+	pinned.store(-1);
+}
+
+/**
+ * Offers a (raw, unblurred) frame to learn from. Never blocks, the frame
+ * is dropped when it isn't due or the worker is still busy.
+ *
+ * args: frame: must not be modified afterwards
+ */
+void BackgroundModel::post(Mat frame) {
+	if (++posted < updateInterval)
+		return;
+
+	unique_lock<mutex> lock(jobMutex, try_to_lock);
+	if (!lock.owns_lock() || busy)
+		return;
+
+	posted = 0;
+	job = frame;
+	busy = true;
+	lock.unlock();
+	jobPosted.notify_one();
+}
+
+void BackgroundModel::work() {
+	while (true) {
+		Mat frame;
+		{
+			unique_lock<mutex> lock(jobMutex);
+			jobPosted.wait(lock, [this]() { return stopping || !job.empty(); });
+			if (stopping) return;
+			frame = job;
+			job = Mat();
+		}
+
+		update(frame);
+
+		lock_guard<mutex> lock(jobMutex);
+		busy = false;
+	}
+}
+
+/**
+ * Learns one frame into the accumulator and publishes the result.
+ */
+void BackgroundModel::update(Mat frame) {
+	Mat blurred;
+	cv::blur(frame, blurred, Size(blurSize, blurSize));
+
+	// Foreground: differs from the (front) background, the worker is its only writer
+	Mat foreground;
+	absdiff(blurred, buffers[front.load()], foreground);
+	threshold(foreground, foreground, thresholdValue, 255, THRESH_BINARY);
+
+	double changed = (double)countNonZero(foreground) / foreground.total();
+	changedUpdates = changed > sceneChangeFraction ? changedUpdates + 1 : 0;
+
+	if (changedUpdates >= sceneChangeUpdates) {
+		// Scene changed as a whole, start over from this frame
+		blurred.convertTo(accumulator, CV_16U, 256);
+		changedUpdates = 0;
+	} else {
+		// Keep a margin around the foreground, its blurred edges aren't background either
+		dilate(foreground, foreground, getStructuringElement(MORPH_RECT, Size(blurSize, blurSize)));
+
+		for (int y = 0; y < accumulator.rows; y++) {
+			tWord* acc = accumulator.ptr<tWord>(y);
+			const tByte* in = blurred.ptr<tByte>(y);
+			const tByte* fg = foreground.ptr<tByte>(y);
+			for (int x = 0; x < accumulator.cols; x++) {
+				int a = acc[x];
+				int delta = ((int)in[x] << 8) - a;
+				acc[x] = fg[x] ? a : a + (delta >> learningShift);
+			}
+		}
+	}
+
+	publish();
+}
+
+/**
+ * Writes the accumulator into the back buffer and makes it the front.
+ */
+void BackgroundModel::publish() {
+	int back = 1 - front.load();
+	while (pinned.load() == back)
+		this_thread::yield(); // Reader still has the previous front, only held for one diff
+
+	accumulator.convertTo(buffers[back], CV_8U, 1.0 / 256);
+	front.store(back);
+}
@@ -0,0 +1,114 @@
+// BackgroundStats.cpp - Per pixel background mean and noise
+#include "BackgroundStats.h"
+
+// std
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+using tWord = unsigned short;
+
+// Noise floor (intensity sd), quantisation keeps even a perfect sensor above this
+static const float minSd = 0.5f;
+
+/**
+ * args: size: frame size
+ *		 thresholdValue: samples further than this from the mean are foreground
+ *		 warmupFrames: frames added before outliers are rejected, the mean
+ *					   isn't reliable before (an animal sitting still through
+ *					   the first few frames would otherwise become background)
+ * throws: invalid_argument iff warmupFrames < 1
+ */
+BackgroundStats::BackgroundStats(Size size, int thresholdValue, int warmupFrames)
+	: size(size), thresholdValue(thresholdValue), warmupFrames(warmupFrames), means(size.area(), 0), m2s(size.area(), 0), counts(size.area(), 0) {
+	if (warmupFrames < 1)
+		throw invalid_argument("Background statistics need at least one warmup frame");
+}
+
+/**
+ * Adds a (blurred) frame.
+ *
+ * throws: runtime_error iff the frame doesn't match
+ */
+void BackgroundStats::add(Mat frame) {
+	if (frame.size() != size || frame.type() != CV_8U)
+		throw runtime_error("Background statistics frame doesn't match the first frame");
+
+	bool rejectOutliers = added >= warmupFrames;
+	int i = 0;
+	for (int y = 0; y < size.height; y++) {
+		const tByte* row = frame.ptr<tByte>(y);
+		for (int x = 0; x < size.width; x++, i++) {
+			float value = row[x];
+			float delta = value - means[i];
+			if (rejectOutliers && fabs(delta) > thresholdValue)
+				continue;
+			if (counts[i] == USHRT_MAX)
+				continue;
+
+			counts[i]++;
+			means[i] += delta / counts[i];
+			m2s[i] += delta * (value - means[i]);
+		}
+	}
+
+	added++;
+}
+
+int BackgroundStats::count() const {
+	return added;
+}
+
+/**
+ * returns: per pixel mean (CV_8U)
+ */
+Mat BackgroundStats::mean() const {
+	Mat out(size, CV_8U);
+	for (int y = 0, i = 0; y < size.height; y++) {
+		tByte* row = out.ptr<tByte>(y);
+		for (int x = 0; x < size.width; x++, i++)
+			row[x] = saturate_cast<tByte>(means[i]);
+	}
+	return out;
+}
+
+/**
+ * returns: per pixel standard deviation (CV_16U, 8.8 fixed point, so
+ *			it survives being saved as a 16-bit png)
+ */
+Mat BackgroundStats::sd() const {
+	Mat out(size, CV_16U);
+	for (int y = 0, i = 0; y < size.height; y++) {
+		tWord* row = out.ptr<tWord>(y);
+		for (int x = 0; x < size.width; x++, i++) {
+			float variance = counts[i] > 1 ? m2s[i] / (counts[i] - 1) : 0;
+			row[x] = saturate_cast<tWord>(max(sqrt(variance), minSd) * 256);
+		}
+	}
+	return out;
+}
+
+/**
+ * Per pixel threshold for diffThresholdMap().
+ *
+ * args: sd: as returned by sd()
+ *		 sigmas: differences above this many standard deviations are foreground
+ *		 minimum: lowest threshold, the global one, so quiet pixels don't
+ *				  turn sensor noise into foreground
+ * returns: threshold map (CV_8U)
+ */
+Mat BackgroundStats::thresholdMap(Mat sd, float sigmas, int minimum) {
+	Mat thresholds;
+	sd.convertTo(thresholds, CV_8U, sigmas / 256);
+	max(thresholds, (double)minimum, thresholds);
+	return thresholds;
+}
@@ -0,0 +1,175 @@
+// CsvWriter.cpp - Asynchronous buffered CSV data file writer
+#include "CsvWriter.h"
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Longest formatted value: sign, 19 digits, point and decimals fit in 32
+static const int valueLimit = 32;
+
+/**
+ * Writes the decimal digits of v.
+ *
+ * returns: end of the written characters
+ */
+static char* formatUnsigned(char* p, uint64_t v) {
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v > 0);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+/**
+ * Writes v rounded like the stream in writeCsvRow(): integers with
+ * llround (halves away from zero), decimals like fixed and
+ * setprecision(decimals). Values within rounding error of a half are
+ * left to the C runtime, so the stream's tie rule applies to them.
+ *
+ * args: p: output, at least valueLimit characters
+ *		 v
+ *		 decimals
+ * returns: end of the written characters
+ */
+static char* formatFixed(char* p, double v, int decimals) {
+	static const int64_t powers[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+	// Not a position, rare enough for the slow path
+	if (!isfinite(v) || fabs(v) >= 1e15 || decimals >= (int)(sizeof(powers) / sizeof(powers[0])))
+		return p + std::min(snprintf(p, valueLimit, "%g", v), valueLimit - 1);
+
+	if (decimals <= 0) {
+		int64_t rounded = llround(v);
+		if (rounded < 0) {
+			*p++ = '-';
+			rounded = -rounded;
+		}
+		return formatUnsigned(p, (uint64_t)rounded);
+	}
+
+	int64_t scale = powers[decimals];
+	double scaled = fabs(v) * scale;
+	if (fabs(scaled - floor(scaled) - 0.5) < 1e-6)
+		return p + std::min(snprintf(p, valueLimit, "%.*f", decimals, v), valueLimit - 1);
+
+	// The stream writes -0.0 too
+	if (signbit(v))
+		*p++ = '-';
+	int64_t rounded = llround(scaled);
+	p = formatUnsigned(p, (uint64_t)(rounded / scale));
+	*p++ = '.';
+	int64_t fraction = rounded % scale;
+	for (int d = decimals - 1; d >= 0; d--) {
+		p[d] = (char)('0' + fraction % 10);
+		fraction /= 10;
+	}
+	return p + decimals;
+}
+
+/**
+ * args: fileName
+ *		 columns: scale 1 columns are written as integers, others with
+ *				  one decimal per factor 10 of the scale
+ *		 flushInterval: longest time (ms) rows stay in memory
+ *		 bufferSize: per buffer (bytes), rows written between flushes must fit
+ * throws: runtime_error iff the file can't be created
+ */
+CsvWriter::CsvWriter(string fileName, vector<TrajectoryColumn> columns, int flushInterval, size_t bufferSize)
+	: out(fileName, ios::binary | ios::trunc), columns(columns), flushInterval(flushInterval) {
+	if (!out.is_open())
+		throw runtime_error("Can't create data file \"" + fileName + "\"");
+
+	for (const TrajectoryColumn& column : columns)
+		decimals.push_back((int)ceil(log10(column.scale)));
+	rowLimit = columns.size() * (valueLimit + 1) + 1;
+
+	active.resize(std::max(bufferSize, rowLimit));
+	writing.resize(active.size());
+
+	writeCsvHeader(out, columns);
+	flusher = thread(&CsvWriter::flushLoop, this);
+}
+
+CsvWriter::~CsvWriter() {
+	close();
+}
+
+/**
+ * Formats a row, one value per column, into the buffer.
+ */
+void CsvWriter::write(const vector<double>& row) {
+	unique_lock<mutex> lock(bufferMutex);
+	if (stopping) return;
+	if (used + rowLimit > active.size()) {
+		full = true;
+		bufferChanged.notify_one();
+		bufferChanged.wait(lock, [this]() { return used + rowLimit <= active.size(); });
+	}
+
+	char* start = active.data() + used;
+	char* p = start;
+	for (size_t c = 0; c < columns.size(); c++) {
+		if (c > 0) *p++ = ',';
+		p = formatFixed(p, row[c], decimals[c]);
+	}
+	*p++ = '\n';
+	used += p - start;
+}
+
+/**
+ * Writes the remaining rows and closes the file, further rows are
+ * ignored.
+ */
+void CsvWriter::close() {
+	{
+		lock_guard<mutex> lock(bufferMutex);
+		stopping = true;
+	}
+	bufferChanged.notify_all();
+	if (flusher.joinable())
+		flusher.join();
+	out.close();
+}
+
+/**
+ * Flush thread: swaps the buffers every interval (or when the active
+ * one is full) and writes the filled one outside the lock.
+ */
+void CsvWriter::flushLoop() {
+	unique_lock<mutex> lock(bufferMutex);
+	while (true) {
+		bufferChanged.wait_for(lock, flushInterval, [this]() { return full || stopping; });
+		bool last = stopping;
+
+		swap(active, writing);
+		size_t bytes = used;
+		used = 0;
+		full = false;
+		bufferChanged.notify_all();
+
+		lock.unlock();
+		if (bytes > 0) {
+			out.write(writing.data(), bytes);
+			out.flush();
+		}
+		lock.lock();
+
+		if (last) return;
+	}
+}
@@ -0,0 +1,330 @@
+// DepthArchive.cpp - Lossless compressed archive of raw 16-bit depth frames
+#include "DepthArchive.h"
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "ThreadPool.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+static const char archiveMagic[4] = { 'K', 'M', 'T', 'D' };
+static const uint16_t archiveVersion = 2; // 1 had no origin
+
+// Residuals sharing one bit width
+static const int groupSize = 16;
+
+// Rows per strip (compression task)
+static const int stripRows = 32;
+
+// Frames being compressed per worker before write() waits
+static const int inFlightPerThread = 2;
+
+template<typename T>
+static void put(ostream& out, T value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static bool get(istream& in, T& value) {
+	return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+static inline uint32_t zigzag(int32_t v) {
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v) {
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/**
+ * Predicted value of pixel x of a row: the previous frame, or the left
+ * (upper for the first column) neighbour in key frames.
+ */
+static inline int predict(const uint16_t* row, const uint16_t* above, const uint16_t* previous, int x) {
+	if (previous) return previous[x];
+	if (x > 0) return row[x - 1];
+	return above ? above[0] : 0;
+}
+
+/**
+ * Compresses rows [begin, end) of a frame.
+ *
+ * args: frame: CV_16U
+ *		 previous: previous frame, empty for a key frame
+ *		 begin, end: rows
+ * returns: payload
+ */
+static vector<uint8_t> compressStrip(Mat frame, Mat previous, int begin, int end) {
+	int width = frame.cols;
+	int count = (end - begin) * width;
+	vector<uint32_t> residuals(count + groupSize, 0);
+	for (int y = begin, i = 0; y < end; y++) {
+		const uint16_t* row = frame.ptr<uint16_t>(y);
+		const uint16_t* above = y > begin ? frame.ptr<uint16_t>(y - 1) : nullptr;
+		const uint16_t* prev = previous.empty() ? nullptr : previous.ptr<uint16_t>(y);
+		for (int x = 0; x < width; x++)
+			residuals[i++] = zigzag((int32_t)row[x] - predict(row, above, prev, x));
+	}
+
+	// Width byte then 16 * width bits per group, worst case 17 bits per pixel
+	vector<uint8_t> out(count / groupSize * (1 + 2 * 17) + 1 + 2 * 17 + 8);
+	uint8_t* p = out.data();
+	for (int g = 0; g < count; g += groupSize) {
+		uint32_t any = 0;
+		for (int k = 0; k < groupSize; k++)
+			any |= residuals[g + k];
+		int bits = 0;
+		while (any >> bits) bits++;
+		*p++ = (uint8_t)bits;
+		if (bits == 0) continue;
+
+		uint64_t accumulator = 0;
+		int filled = 0;
+		for (int k = 0; k < groupSize; k++) {
+			accumulator |= (uint64_t)residuals[g + k] << filled;
+			filled += bits;
+			while (filled >= 8) {
+				*p++ = (uint8_t)accumulator;
+				accumulator >>= 8;
+				filled -= 8;
+			}
+		}
+	}
+	out.resize(p - out.data());
+	return out;
+}
+
+/**
+ * Decompresses rows [begin, end) of a frame, see compressStrip().
+ *
+ * throws: runtime_error iff the payload is too short
+ */
+static void decompressStrip(const vector<uint8_t>& in, Mat frame, Mat previous, int begin, int end) {
+	int width = frame.cols;
+	int count = (end - begin) * width;
+	const uint8_t* p = in.data();
+	const uint8_t* last = p + in.size();
+
+	uint32_t residuals[groupSize];
+	int x = 0, y = begin;
+	for (int g = 0; g < count; g += groupSize) {
+		if (p >= last) throw runtime_error("Corrupt depth archive strip");
+		int bits = *p++;
+		if (bits > 17 || p + 2 * bits > last) throw runtime_error("Corrupt depth archive strip");
+
+		uint64_t accumulator = 0;
+		int filled = 0;
+		uint32_t mask = (1u << bits) - 1;
+		for (int k = 0; k < groupSize; k++) {
+			while (filled < bits) {
+				accumulator |= (uint64_t)*p++ << filled;
+				filled += 8;
+			}
+			residuals[k] = (uint32_t)accumulator & mask;
+			accumulator >>= bits;
+			filled -= bits;
+		}
+
+		for (int k = 0; k < groupSize && g + k < count; k++) {
+			uint16_t* row = frame.ptr<uint16_t>(y);
+			const uint16_t* above = y > begin ? frame.ptr<uint16_t>(y - 1) : nullptr;
+			const uint16_t* prev = previous.empty() ? nullptr : previous.ptr<uint16_t>(y);
+			row[x] = (uint16_t)(predict(row, above, prev, x) + unzigzag(residuals[k]));
+			if (++x == width) {
+				x = 0;
+				y++;
+			}
+		}
+	}
+}
+
+/**
+ * args: fileName
+ *		 region: of the sensor frame the frames are (the crop)
+ *		 threads: compression workers
+ *		 keyInterval: frames between key frames (decodable on their own)
+ * throws: runtime_error iff the file can't be created
+ */
+DepthArchiveWriter::DepthArchiveWriter(string fileName, Rect region, int threads, int keyInterval)
+	: out(fileName, ios::binary | ios::trunc), size(region.size()), keyInterval(std::max(keyInterval, 1)), pool(new ThreadPool(threads)) {
+	if (!out.is_open())
+		throw runtime_error("Can't create depth archive \"" + fileName + "\"");
+
+	strips = (size.height + stripRows - 1) / stripRows;
+	out.write(archiveMagic, 4);
+	put<uint16_t>(out, archiveVersion);
+	put<uint16_t>(out, (uint16_t)size.width);
+	put<uint16_t>(out, (uint16_t)size.height);
+	put<uint16_t>(out, (uint16_t)strips);
+	put<uint16_t>(out, (uint16_t)region.x);
+	put<uint16_t>(out, (uint16_t)region.y);
+}
+
+DepthArchiveWriter::~DepthArchiveWriter() {
+	close();
+}
+
+/**
+ * Queues a frame for compression and writes the frames that are done.
+ *
+ * args: depth: CV_16U, the archive's size
+ *		 t: time of capture (ms)
+ * throws: invalid_argument iff the frame doesn't match the archive
+ */
+void DepthArchiveWriter::write(Mat depth, unsigned t) {
+	if (!out.is_open()) return;
+	if (depth.type() != CV_16U || depth.size() != size)
+		throw invalid_argument("Depth archive frames must be CV_16U and " + to_string(size.width) + " * " + to_string(size.height));
+
+	// The copy is owned by this frame's tasks and the next frame's
+	Mat frame = depth.clone();
+	bool key = frames++ % keyInterval == 0;
+	Mat reference = key ? Mat() : previous;
+	previous = frame;
+
+	Pending entry = { t, key, make_shared<vector<vector<uint8_t>>>(strips), {} };
+	for (int s = 0; s < strips; s++) {
+		int begin = s * stripRows, end = std::min(begin + stripRows, size.height);
+		shared_ptr<vector<vector<uint8_t>>> payloads = entry.payloads;
+		entry.done.push_back(pool->submit([payloads, frame, reference, s, begin, end]() {
+			(*payloads)[s] = compressStrip(frame, reference, begin, end);
+		}));
+	}
+	pending.push_back(move(entry));
+
+	writeReady(pending.size() > (size_t)pool->size() * inFlightPerThread);
+}
+
+/**
+ * Writes the remaining frames and closes the file.
+ */
+void DepthArchiveWriter::close() {
+	if (!out.is_open()) return;
+	while (!pending.empty())
+		writeReady(true);
+	out.close();
+}
+
+/**
+ * returns: compressed bytes written so far
+ */
+uint64_t DepthArchiveWriter::bytesWritten() const {
+	return bytes;
+}
+
+/**
+ * Writes the oldest frames whose strips are all compressed.
+ *
+ * args: wait: block for (at least) the oldest frame
+ */
+void DepthArchiveWriter::writeReady(bool wait) {
+	while (!pending.empty()) {
+		Pending& front = pending.front();
+		if (!wait) {
+			for (future<void>& strip : front.done)
+				if (strip.wait_for(chrono::seconds(0)) != future_status::ready) return;
+		}
+		wait = false;
+
+		for (future<void>& strip : front.done)
+			strip.get();
+		const vector<vector<uint8_t>>& payloads = *front.payloads;
+
+		put<uint32_t>(out, front.t);
+		put<uint8_t>(out, front.key ? 1 : 0);
+		for (const vector<uint8_t>& payload : payloads)
+			put<uint32_t>(out, (uint32_t)payload.size());
+		for (const vector<uint8_t>& payload : payloads) {
+			out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+			bytes += payload.size() + 4;
+		}
+		bytes += 5;
+		pending.pop_front();
+	}
+}
+
+/**
+ * throws: runtime_error iff the file can't be read or isn't a depth archive
+ */
+DepthArchiveReader::DepthArchiveReader(string fileName, int threads) : in(fileName, ios::binary), pool(new ThreadPool(threads)) {
+	if (!in.is_open())
+		throw runtime_error("Can't open depth archive \"" + fileName + "\"");
+
+	char magic[4];
+	uint16_t version, width, height, stripCount;
+	if (!in.read(magic, 4) || memcmp(magic, archiveMagic, 4) != 0 || !get(in, version) || !get(in, width) || !get(in, height) || !get(in, stripCount))
+		throw runtime_error("\"" + fileName + "\" is not a depth archive");
+	uint16_t x = 0, y = 0;
+	if (version < 1 || version > archiveVersion || (version >= 2 && (!get(in, x) || !get(in, y))))
+		throw runtime_error("Unsupported depth archive version " + to_string(version));
+
+	frameSize = Size(width, height);
+	frameOrigin = Point(x, y);
+	strips = stripCount;
+	payloads.resize(strips);
+}
+
+Size DepthArchiveReader::size() const {
+	return frameSize;
+}
+
+/**
+ * returns: position of the frames in the sensor frame, (0, 0) in
+ *			version 1 archives
+ */
+Point DepthArchiveReader::origin() const {
+	return frameOrigin;
+}
+
+/**
+ * Reads the next frame.
+ *
+ * args: depth: output, CV_16U, a new Mat every frame
+ *		 t: output, time of capture (ms)
+ * returns: false at the end (or a truncated last frame)
+ * throws: runtime_error iff the archive is corrupt
+ */
+bool DepthArchiveReader::read(Mat& depth, unsigned& t) {
+	uint32_t time;
+	uint8_t key;
+	if (!get(in, time) || !get(in, key))
+		return false;
+
+	vector<uint32_t> lengths(strips);
+	for (uint32_t& length : lengths)
+		if (!get(in, length)) return false;
+	for (int s = 0; s < strips; s++) {
+		payloads[s].resize(lengths[s]);
+		if (!in.read(reinterpret_cast<char*>(payloads[s].data()), lengths[s])) return false;
+	}
+	if (!key && previous.empty())
+		throw runtime_error("Depth archive doesn't start with a key frame");
+
+	Mat frame(frameSize, CV_16U);
+	Mat reference = key ? Mat() : previous;
+	pool->parallelFor(strips, [&](int s) {
+		int begin = s * stripRows, end = std::min(begin + stripRows, frameSize.height);
+		decompressStrip(payloads[s], frame, reference, begin, end);
+	});
+
+	previous = frame;
+	depth = frame;
+	t = time;
+	return true;
+}
@@ -0,0 +1,112 @@
+// DirtyTiles.cpp - Change detection on a grid of tiles
+#include "DirtyTiles.h"
+
+// Internal
+#include "Kernels.h"
+
+// std
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * args: frameSize
+ *		 tileSize: tile width and height (px)
+ *		 changeThreshold: a pixel changed when it differs more than this
+ *		 minChanged: a tile changed when at least this many pixels did,
+ *					 single pixel flicker is ignored
+ */
+DirtyTiles::DirtyTiles(Size frameSize, int tileSize, int changeThreshold, int minChanged)
+	: frameSize(frameSize), size(tileSize), changeThreshold(changeThreshold), minChanged(minChanged) {
+	grid = Size((frameSize.width + size - 1) / size, (frameSize.height + size - 1) / size);
+	valid.assign(grid.area(), false);
+}
+
+/**
+ * Finds the tiles in the window to reprocess and takes their current
+ * input as the new reference, the caller has to recompute them.
+ *
+ * args: frame: full frame
+ *		 bg: full background, empty for none
+ *		 window: only tiles overlapping this are checked
+ * returns: regions to reprocess (full frame, clipped to the frame),
+ *			horizontal runs of dirty tiles
+ * throws: runtime_error iff the frame doesn't match
+ */
+vector<Rect> DirtyTiles::update(Mat frame, Mat bg, Rect window) {
+	if (frame.size() != frameSize)
+		throw runtime_error("Frame doesn't match the tiles");
+	if (frameRef.empty() || frameRef.type() != frame.type()) {
+		frameRef.create(frameSize, frame.type());
+		invalidate();
+	}
+	if (!bg.empty() && (bgRef.empty() || bgRef.type() != bg.type())) {
+		bgRef.create(frameSize, bg.type());
+		invalidate();
+	}
+
+	int tx0 = window.x / size, tx1 = (window.x + window.width - 1) / size;
+	int ty0 = window.y / size, ty1 = (window.y + window.height - 1) / size;
+
+	// Changed tiles, then grown by one tile for the blur
+	vector<bool> dirty(grid.area(), false);
+	for (int ty = ty0; ty <= ty1; ty++) {
+		for (int tx = tx0; tx <= tx1; tx++) {
+			if (valid[ty * grid.width + tx] && !changed(tx, ty, frame, bg)) continue;
+			for (int ny = std::max(ty - 1, ty0); ny <= std::min(ty + 1, ty1); ny++)
+				for (int nx = std::max(tx - 1, tx0); nx <= std::min(tx + 1, tx1); nx++)
+					dirty[ny * grid.width + nx] = true;
+		}
+	}
+
+	vector<Rect> runs;
+	for (int ty = ty0; ty <= ty1; ty++) {
+		for (int tx = tx0; tx <= tx1; tx++) {
+			if (!dirty[ty * grid.width + tx]) continue;
+
+			int start = tx;
+			while (tx + 1 <= tx1 && dirty[ty * grid.width + tx + 1])
+				tx++;
+			Rect run = tileRect(start, ty) | tileRect(tx, ty);
+			runs.push_back(run);
+
+			frame(run).copyTo(frameRef(run));
+			if (!bg.empty()) bg(run).copyTo(bgRef(run));
+			for (int i = start; i <= tx; i++)
+				valid[ty * grid.width + i] = true;
+		}
+	}
+
+	return runs;
+}
+
+/**
+ * Marks every tile dirty, e.g. after a change that isn't in the inputs.
+ */
+void DirtyTiles::invalidate() {
+	fill(valid.begin(), valid.end(), false);
+}
+
+int DirtyTiles::tileSize() const {
+	return size;
+}
+
+/**
+ * returns: true iff the tile's frame or background moved away from
+ *			the reference
+ */
+bool DirtyTiles::changed(int tx, int ty, const Mat& frame, const Mat& bg) const {
+	Rect r = tileRect(tx, ty);
+	if (countChanged(frame(r), frameRef(r), changeThreshold, minChanged) >= minChanged)
+		return true;
+	return !bg.empty() && countChanged(bg(r), bgRef(r), changeThreshold, minChanged) >= minChanged;
+}
+
+Rect DirtyTiles::tileRect(int tx, int ty) const {
+	return Rect(tx * size, ty * size, size, size) & Rect(Point(0, 0), frameSize);
+}
@@ -0,0 +1,198 @@
+// FloorModel.cpp - Expected depth of the empty arena from fitted planes
+#include "FloorModel.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tWord = unsigned short;
+
+// Every n-th pixel (both directions) is a plane fitting sample
+static const int sampleStep = 2;
+
+// RANSAC hypotheses per plane
+static const int ransacIterations = 300;
+
+// A plane has to explain this fraction of the samples
+static const double minPlaneFraction = 0.03;
+
+FloorModel::FloorModel() {}
+
+/**
+ * args: expected: expected depth as returned by expected() (e.g. loaded from file)
+ */
+FloorModel::FloorModel(Mat expected) : expectedDepth(expected) {}
+
+/**
+ * Adds a raw depth frame (CV_16U, mm) to learn from, the animal may be
+ * present: per pixel the deepest valid depth is kept.
+ *
+ * throws: runtime_error iff the frame doesn't match
+ */
+void FloorModel::add(Mat depth) {
+	if (depth.type() != CV_16U)
+		throw runtime_error("Floor model needs raw depth frames");
+
+	if (reference.empty()) {
+		reference = depth.clone();
+	} else {
+		if (depth.size() != reference.size())
+			throw runtime_error("Floor model frame doesn't match the first frame");
+		cv::max(reference, depth, reference);
+	}
+	added++;
+}
+
+int FloorModel::count() const {
+	return added;
+}
+
+/**
+ * Fits the floor and up to the given number of wall planes (sequential
+ * RANSAC) and computes the expected depth per pixel.
+ *
+ * args: walls: maximum number of planes after the floor
+ *		 tolerance: plane inlier distance (mm)
+ * returns: number of planes found
+ * throws: runtime_error iff no frames were added or no floor was found
+ */
+int FloorModel::fit(int walls, float tolerance) {
+	if (reference.empty())
+		throw runtime_error("Floor model has no frames to fit");
+
+	vector<Point3f> samples;
+	for (int v = 0; v < reference.rows; v += sampleStep) {
+		const tWord* row = reference.ptr<tWord>(v);
+		for (int u = 0; u < reference.cols; u += sampleStep)
+			if (row[u] > 0) samples.push_back(Point3f((float)u, (float)v, (float)row[u]));
+	}
+	int minInliers = max(3, (int)(samples.size() * minPlaneFraction));
+
+	vector<Plane> planes;
+	vector<Point3f> remaining = samples;
+	for (int i = 0; i <= walls && remaining.size() >= minInliers; i++) {
+		int inliers;
+		Plane plane = ransac(remaining, tolerance, inliers);
+		if (inliers < minInliers)
+			break;
+
+		vector<Point3f> fitted, rest;
+		for (const Point3f& p : remaining)
+			(fabs(p.z - plane.depth(p.x, p.y)) < tolerance ? fitted : rest).push_back(p);
+		solvePlane(fitted, plane); // Refine on all inliers
+
+		planes.push_back(plane);
+		remaining.swap(rest);
+	}
+
+	if (planes.empty())
+		throw runtime_error("No floor plane found in the depth stream");
+
+	// Expected depth: closest plane within tolerance, else what was seen
+	expectedDepth.create(reference.size(), CV_16U);
+	for (int v = 0; v < reference.rows; v++) {
+		const tWord* ref = reference.ptr<tWord>(v);
+		tWord* out = expectedDepth.ptr<tWord>(v);
+		for (int u = 0; u < reference.cols; u++) {
+			double best = ref[u];
+			double bestDist = tolerance;
+			for (const Plane& plane : planes) {
+				double z = plane.depth(u, v);
+				double dist = fabs(z - ref[u]);
+				if (ref[u] > 0 && dist < bestDist) {
+					bestDist = dist;
+					best = z;
+				}
+			}
+			out[u] = saturate_cast<tWord>(best);
+		}
+	}
+
+	return (int)planes.size();
+}
+
+/**
+ * returns: expected depth of the empty arena (CV_16U, mm, 0 where unknown)
+ */
+Mat FloorModel::expected() const {
+	return expectedDepth;
+}
+
+/**
+ * args: height: minimum height above the model (mm) of the animal
+ * returns: depth limit per pixel (CV_16U), closer than this is the
+ *			animal, 0 where nothing can be
+ */
+Mat FloorModel::limit(float height) const {
+	Mat lim;
+	expectedDepth.convertTo(lim, CV_16U, 1, -height); // Saturates at 0
+	return lim;
+}
+
+double FloorModel::Plane::depth(double u, double v) const {
+	double inv = a * u + b * v + c;
+	return inv > 0 ? 1 / inv : 0;
+}
+
+/**
+ * Least squares plane (in 1 / z) through the points.
+ *
+ * returns: false iff degenerate
+ */
+bool FloorModel::solvePlane(const vector<Point3f>& points, Plane& plane) {
+	// Normal equations of [u v 1] * [a b c]' = 1 / z
+	Matx33d ata = Matx33d::zeros();
+	Vec3d atb(0, 0, 0);
+	for (const Point3f& p : points) {
+		Vec3d row(p.x, p.y, 1);
+		double w = 1 / p.z;
+		ata += row * row.t();
+		atb += row * w;
+	}
+
+	Vec3d x;
+	if (!cv::solve(ata, atb, x, DECOMP_CHOLESKY))
+		return false;
+
+	plane.a = x[0];
+	plane.b = x[1];
+	plane.c = x[2];
+	return true;
+}
+
+/**
+ * returns: plane through 3 random samples with the most inliers
+ */
+FloorModel::Plane FloorModel::ransac(const vector<Point3f>& samples, float tolerance, int& inliers) const {
+	mt19937 rng(42); // Deterministic, the same depth gives the same model
+	uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+
+	Plane best = { 0, 0, 0 };
+	inliers = 0;
+	for (int i = 0; i < ransacIterations; i++) {
+		vector<Point3f> triple = { samples[pick(rng)], samples[pick(rng)], samples[pick(rng)] };
+		Plane plane;
+		if (!solvePlane(triple, plane))
+			continue;
+
+		int count = 0;
+		for (const Point3f& p : samples)
+			if (fabs(p.z - plane.depth(p.x, p.y)) < tolerance) count++;
+
+		if (count > inliers) {
+			inliers = count;
+			best = plane;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,51 @@
+// FollowCrop.cpp - Fixed size window following the tracked animal
+#include "FollowCrop.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Part of the half window the position may get away from the center before it is pulled along
+static const float marginFactor = 0.5f;
+
+/**
+ * args: frameSize
+ *		 size: of the window's sides (px), at most the frame's
+ *		 smoothing: part of the way to the position the window moves per update
+ */
+FollowCrop::FollowCrop(Size frameSize, int size, float smoothing)
+	: frameSize(frameSize), windowSize(std::min(size, frameSize.width), std::min(size, frameSize.height)), smoothing(smoothing),
+	  center(frameSize.width / 2.0f, frameSize.height / 2.0f) {}
+
+/**
+ * Moves the window towards the position.
+ *
+ * args: position: in the frame, (0, 0) while nothing was found yet
+ * returns: window in the frame, always size()
+ */
+Rect FollowCrop::update(Point2f position) {
+	if (position != Point2f(0, 0)) {
+		center += (position - center) * smoothing;
+
+		// Pull along when the position gets too far from the center
+		float reachX = windowSize.width / 2.0f * marginFactor;
+		float reachY = windowSize.height / 2.0f * marginFactor;
+		center.x = std::min(std::max(center.x, position.x - reachX), position.x + reachX);
+		center.y = std::min(std::max(center.y, position.y - reachY), position.y + reachY);
+	}
+
+	int x = (int)lround(center.x - windowSize.width / 2.0f);
+	int y = (int)lround(center.y - windowSize.height / 2.0f);
+	x = std::min(std::max(x, 0), frameSize.width - windowSize.width);
+	y = std::min(std::max(y, 0), frameSize.height - windowSize.height);
+	return Rect(Point(x, y), windowSize);
+}
+
+Size FollowCrop::size() const {
+	return windowSize;
+}
@@ -0,0 +1,87 @@
+// Heading.cpp - Body orientation and head/tail direction of a blob
+#include "Heading.h"
+
+// std
+#include <cmath>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Below this elongation the blob is too round (e.g. curled up) for a reliable axis
+static const float minElongation = 1.2f;
+
+// Above this speed (px/s) the direction of motion decides which end is the head
+static const float minHeadingSpeed = 30;
+
+/**
+ * Angle between two directions (rad), [0, pi].
+ */
+static float angleBetween(float a, float b) {
+	float d = fmod(fabs(a - b), 2 * (float)CV_PI);
+	return d > CV_PI ? 2 * (float)CV_PI - d : d;
+}
+
+static float wrap(float a) {
+	a = fmod(a, 2 * (float)CV_PI);
+	return a < 0 ? a + 2 * (float)CV_PI : a;
+}
+
+/**
+ * Sets a blob's axis angle and elongation from its second order
+ * central moments.
+ */
+void setBlobShape(Blob& blob, double mu20, double mu11, double mu02) {
+	blob.angle = 0.5f * (float)atan2(2 * mu11, mu20 - mu02);
+
+	double common = sqrt(4 * mu11 * mu11 + (mu20 - mu02) * (mu20 - mu02));
+	double major = (mu20 + mu02 + common) / 2;
+	double minor = (mu20 + mu02 - common) / 2;
+	blob.elongation = minor > 0 ? (float)sqrt(major / minor) : 1;
+}
+
+/**
+ * args: blob: detection the position was taken from, shape set
+ *		 velocity: of the track (px/s)
+ */
+void HeadingFilter::update(const Blob& blob, Point2f velocity) {
+	elong = blob.elongation;
+	if (elong < minElongation && initialised)
+		return; // Keep the last axis and heading
+
+	axis = blob.angle;
+	float forward = wrap(axis);
+	float backward = wrap(axis + (float)CV_PI);
+
+	float speed = (float)norm(velocity);
+	if (speed >= minHeadingSpeed) {
+		float motion = atan2(velocity.y, velocity.x);
+		head = angleBetween(forward, motion) <= angleBetween(backward, motion) ? forward : backward;
+	} else if (initialised) {
+		head = angleBetween(forward, head) <= angleBetween(backward, head) ? forward : backward;
+	} else {
+		head = forward;
+	}
+
+	initialised = true;
+}
+
+/**
+ * returns: body axis (deg), [0, 180)
+ */
+float HeadingFilter::angle() const {
+	float deg = axis * 180 / (float)CV_PI;
+	return deg < 0 ? deg + 180 : deg;
+}
+
+float HeadingFilter::elongation() const {
+	return elong;
+}
+
+/**
+ * returns: heading (deg), [0, 360)
+ */
+float HeadingFilter::heading() const {
+	return head * 180 / (float)CV_PI;
+}
@@ -0,0 +1,255 @@
+// Kernels.cpp - Vectorised per pixel kernels
+#include "Kernels.h"
+
+// std
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+using tWord = unsigned short;
+
+/**
+ * Thresholds the absolute difference with the background against a per
+ * pixel threshold in one pass: mask = |frame - bg| > thresholds ? 255 : 0
+ *
+ * args: frame: CV_8U
+ *		 bg: CV_8U, same size
+ *		 thresholds: CV_8U, same size
+ *		 mask: output, CV_8U
+ */
+void diffThresholdMap(const Mat& frame, const Mat& bg, const Mat& thresholds, Mat& mask) {
+	mask.create(frame.size(), CV_8U);
+
+	for (int y = 0; y < frame.rows; y++) {
+		const tByte* f = frame.ptr<tByte>(y);
+		const tByte* b = bg.ptr<tByte>(y);
+		const tByte* t = thresholds.ptr<tByte>(y);
+		tByte* m = mask.ptr<tByte>(y);
+
+		int x = 0;
+#if CV_SIMD128
+		for (; x <= frame.cols - 16; x += 16) {
+			v_uint8x16 diff = v_absdiff(v_load(f + x), v_load(b + x));
+			v_store(m + x, diff > v_load(t + x));
+		}
+#endif
+		for (; x < frame.cols; x++)
+			m[x] = abs(f[x] - b[x]) > t[x] ? 255 : 0;
+	}
+}
+
+/**
+ * Thresholds the absolute difference with the background and counts
+ * the differences in the same pass: mask = |frame - bg| > threshold ? 255 : 0
+ *
+ * args: frame: CV_8U
+ *		 bg: CV_8U, same size
+ *		 threshold
+ *		 mask: output, CV_8U
+ *		 hist: 256 bins the differences are added to
+ */
+void diffThresholdHist(const Mat& frame, const Mat& bg, int threshold, Mat& mask, unsigned int* hist) {
+	mask.create(frame.size(), CV_8U);
+	vector<tByte> diffs(frame.cols);
+	tByte* d = diffs.data();
+
+	for (int y = 0; y < frame.rows; y++) {
+		const tByte* f = frame.ptr<tByte>(y);
+		const tByte* b = bg.ptr<tByte>(y);
+		tByte* m = mask.ptr<tByte>(y);
+
+		int x = 0;
+#if CV_SIMD128
+		v_uint8x16 t = v_setall_u8((tByte)std::min(std::max(threshold, 0), 255));
+		for (; x <= frame.cols - 16; x += 16) {
+			v_uint8x16 diff = v_absdiff(v_load(f + x), v_load(b + x));
+			v_store(d + x, diff);
+			v_store(m + x, diff > t);
+		}
+#endif
+		for (; x < frame.cols; x++) {
+			d[x] = (tByte)abs(f[x] - b[x]);
+			m[x] = d[x] > threshold ? 255 : 0;
+		}
+
+		// Still in L1, the counting is all that's added to a plain diff
+		for (x = 0; x < frame.cols; x++)
+			hist[d[x]]++;
+	}
+}
+
+/**
+ * Marks valid depths closer than a per pixel limit in one pass:
+ * mask = 0 < depth < limit ? 255 : 0
+ *
+ * args: depth: CV_16U
+ *		 limit: CV_16U, same size
+ *		 mask: output, CV_8U
+ */
+void closerThan(const Mat& depth, const Mat& limit, Mat& mask) {
+	mask.create(depth.size(), CV_8U);
+
+	for (int y = 0; y < depth.rows; y++) {
+		const tWord* d = depth.ptr<tWord>(y);
+		const tWord* l = limit.ptr<tWord>(y);
+		tByte* m = mask.ptr<tByte>(y);
+
+		int x = 0;
+#if CV_SIMD128
+		v_uint16x8 zero = v_setzero_u16();
+		for (; x <= depth.cols - 16; x += 16) {
+			v_uint16x8 d0 = v_load(d + x), d1 = v_load(d + x + 8);
+			v_uint16x8 m0 = (d0 < v_load(l + x)) & (d0 > zero);
+			v_uint16x8 m1 = (d1 < v_load(l + x + 8)) & (d1 > zero);
+			v_store(m + x, v_pack(m0, m1)); // 0xFFFF saturates to 0xFF
+		}
+#endif
+		for (; x < depth.cols; x++)
+			m[x] = d[x] > 0 && d[x] < l[x] ? 255 : 0;
+	}
+}
+
+// Number of set bits
+static int popCount(unsigned int bits) {
+	int n = 0;
+	for (; bits; bits &= bits - 1)
+		n++;
+	return n;
+}
+
+/**
+ * Counts the pixels that differ more than a threshold, stopping once
+ * the limit is reached.
+ *
+ * args: a: CV_8U or CV_16U
+ *		 b: same size and type
+ *		 threshold
+ *		 limit
+ * returns: count, at most about limit (0 for other types)
+ */
+int countChanged(const Mat& a, const Mat& b, int threshold, int limit) {
+	int count = 0;
+
+	for (int y = 0; y < a.rows && count < limit; y++) {
+		int x = 0;
+		if (a.type() == CV_8U) {
+			const tByte* pa = a.ptr<tByte>(y);
+			const tByte* pb = b.ptr<tByte>(y);
+#if CV_SIMD128
+			v_uint8x16 t = v_setall_u8((tByte)std::min(threshold, 255));
+			for (; x <= a.cols - 16; x += 16)
+				count += popCount(v_signmask(v_absdiff(v_load(pa + x), v_load(pb + x)) > t));
+#endif
+			for (; x < a.cols; x++)
+				if (abs(pa[x] - pb[x]) > threshold) count++;
+		} else if (a.type() == CV_16U) {
+			const tWord* pa = a.ptr<tWord>(y);
+			const tWord* pb = b.ptr<tWord>(y);
+#if CV_SIMD128
+			v_uint16x8 t = v_setall_u16((tWord)std::min(threshold, 65535));
+			for (; x <= a.cols - 8; x += 8)
+				count += popCount(v_signmask(v_absdiff(v_load(pa + x), v_load(pb + x)) > t));
+#endif
+			for (; x < a.cols; x++)
+				if (abs(pa[x] - pb[x]) > threshold) count++;
+		}
+	}
+
+	return count;
+}
+
+// Orders a pair so that a <= b, for pixels and vectors of pixels alike
+static inline void sortPair(tByte& a, tByte& b) {
+	tByte lo = std::min(a, b);
+	b = std::max(a, b);
+	a = lo;
+}
+
+static inline void sortPair(tWord& a, tWord& b) {
+	tWord lo = std::min(a, b);
+	b = std::max(a, b);
+	a = lo;
+}
+
+template<typename V>
+static inline void sortPair(V& a, V& b) {
+	V lo = v_min(a, b);
+	b = v_max(a, b);
+	a = lo;
+}
+
+// Median of 3 and 5 with min / max only (sorting networks), no branches
+template<typename V>
+static inline V median3(V a, V b, V c) {
+	sortPair(a, b);
+	sortPair(b, c);
+	sortPair(a, b);
+	return b;
+}
+
+template<typename V>
+static inline V median5(V a, V b, V c, V d, V e) {
+	sortPair(a, b);
+	sortPair(d, e);
+	sortPair(a, d);
+	sortPair(b, e);
+	sortPair(b, c);
+	sortPair(c, d);
+	sortPair(b, c);
+	return c;
+}
+
+template<typename T>
+static void temporalMedianRows(const vector<const Mat*>& frames, Mat& out) {
+	int n = (int)frames.size();
+	const int lanes = 16 / sizeof(T);
+
+	for (int y = 0; y < out.rows; y++) {
+		const T* p[5];
+		for (int i = 0; i < n; i++)
+			p[i] = frames[i]->ptr<T>(y);
+		T* o = out.ptr<T>(y);
+
+		int x = 0;
+#if CV_SIMD128
+		for (; x <= out.cols - lanes; x += lanes) {
+			if (n == 3)
+				v_store(o + x, median3(v_load(p[0] + x), v_load(p[1] + x), v_load(p[2] + x)));
+			else
+				v_store(o + x, median5(v_load(p[0] + x), v_load(p[1] + x), v_load(p[2] + x), v_load(p[3] + x), v_load(p[4] + x)));
+		}
+#endif
+		for (; x < out.cols; x++)
+			o[x] = n == 3 ? median3(p[0][x], p[1][x], p[2][x]) : median5(p[0][x], p[1][x], p[2][x], p[3][x], p[4][x]);
+	}
+}
+
+/**
+ * Per pixel median over 3 or 5 frames.
+ *
+ * args: frames: CV_8U or CV_16U, same size and type
+ *		 out: output, may be one of the frames
+ * throws: runtime_error iff not 3 or 5 frames of a supported type
+ */
+void temporalMedian(const vector<const Mat*>& frames, Mat& out) {
+	if (frames.size() != 3 && frames.size() != 5)
+		throw runtime_error("Temporal median needs 3 or 5 frames");
+
+	const Mat& first = *frames[0];
+	out.create(first.size(), first.type());
+	if (first.type() == CV_8U)
+		temporalMedianRows<tByte>(frames, out);
+	else if (first.type() == CV_16U)
+		temporalMedianRows<tWord>(frames, out);
+	else
+		throw runtime_error("Temporal median needs 8 or 16-bit grayscale frames");
+}
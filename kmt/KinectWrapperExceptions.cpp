@@ -11,4 +11,8 @@ const char* NoReaderException::what() const { return "NoReaderException"; };
 
 NoFrameException::NoFrameException() : exception("No frame yet captured") {};
 NoFrameException::NoFrameException(const char* msg) : exception(msg) {};
-const char * NoFrameException::what() const { return "NoFrameException"; };
\ No newline at end of file
+const char * NoFrameException::what() const { return "NoFrameException"; };
+
+EndOfReplayException::EndOfReplayException() : exception("No frames left to replay") {};
+EndOfReplayException::EndOfReplayException(const char* msg) : exception(msg) {};
+const char * EndOfReplayException::what() const { return "EndOfReplayException"; };
\ No newline at end of file
@@ -4,17 +4,29 @@
 #include "Kmt.h"
 
 // Internal
+#include "BackgroundStats.h"
+#include "Heading.h"
+#include "Kernels.h"
 #include "KinectWrapper.h"
 #include "Util.h"
 
 // std
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <vector>
 using namespace std;
 
 // OpenCV
 #include <opencv2/opencv.hpp>
 using namespace cv;
 
+// Full resolution border around a coarse detection, in coarse px
+static const int pyramidPadding = 2;
+
+// Downsampling of the frame the auto threshold samples its histogram from
+static const int diffSampleFactor = 4;
+
 // Typedef
 using tByte = unsigned char; // Random prefix t to avoid conflict
 using tWord = unsigned short;
@@ -24,10 +36,331 @@ using matSource = Mat(Kmt::*)();
 using matOutput = void(Kmt::*)(Mat(Kmt::*)());
 
 
-Kmt::Kmt() {}
+/**
+ * returns: the position clamped to the pixels of a frame of the given size
+ */
+static Point2f clampToFrame(Point2f pos, Size size) {
+	return Point2f((std::min)((std::max)(pos.x, 0.0f), (float)(size.width - 1)), (std::min)((std::max)(pos.y, 0.0f), (float)(size.height - 1)));
+}
+
+Kmt::Kmt() : kinect(new KinectWrapper()) {}
+
+/**
+ * args: kinect: sensor to acquire from, nullptr for a processing only
+ *				 instance (e.g. one per arena)
+ */
+Kmt::Kmt(shared_ptr<KinectWrapper> kinect) : kinect(kinect) {}
 
 void Kmt::setBg(Mat _bg) {
 	bg = _bg;
+	if (tiles) tiles->invalidate();
+}
+
+/**
+ * Switches diffThreshold() to a per pixel threshold of the given
+ * number of standard deviations of the background noise.
+ *
+ * args: sd: background noise, see BackgroundStats::sd()
+ *		 sigmas
+ *		 minThreshold: lowest per pixel threshold, normally the global one
+ */
+void Kmt::setBgNoise(Mat sd, float sigmas, int minThreshold) {
+	thresholdMap = BackgroundStats::thresholdMap(sd, sigmas, minThreshold);
+	coarseThresholdMap.release();
+	if (tiles) tiles->invalidate();
+}
+
+/**
+ * Switches segment() from background subtraction to the floor model:
+ * the animal is whatever is closer than the given per pixel depth.
+ *
+ * args: limit: see FloorModel::limit(), raw depth frames are expected
+ */
+void Kmt::setFloorLimit(Mat limit) {
+	floorLimit = limit;
+	coarseLimit.release();
+	if (tiles) tiles->invalidate();
+}
+
+/**
+ * Segments the animal from a window of a frame: against the floor model
+ * if set, else by blurring and diffThreshold().
+ *
+ * With tiles enabled only the tiles that changed since they were last
+ * processed (and their neighbours) are, the rest of the mask is reused
+ * while the threshold stays the same.
+ *
+ * With a pyramid the window is first searched at a lower resolution
+ * and narrowed to the patch around the detection(s), only that patch
+ * is segmented at full resolution.
+ *
+ * With an automatic threshold the given one is ignored. Its histogram
+ * is counted while diffing when the whole (masked) frame is, else
+ * sampled from it, see sampleDifferences().
+ *
+ * args: frame: full frame (raw depth with a floor model)
+ *		 window: region to segment, narrowed with a pyramid
+ *		 blurSize
+ *		 thresholdValue
+ * returns: mask of the window
+ */
+Mat Kmt::segment(Mat frame, Rect& window, int blurSize, int thresholdValue) {
+	if (!autoThreshold)
+		return segmentWindow(frame, window, blurSize, thresholdValue);
+
+	// The triangle method needs the mostly background whole (masked) frame, not just the part around the animal
+	Rect whole = arenaMask.empty() ? Rect(Point(0, 0), frame.size()) : arenaMask.bounds();
+	sampleDiffs = tileSize > 0 || pyramidFactor > 1 || (window & whole) != whole;
+
+	Mat mask = segmentWindow(frame, window, blurSize, autoThreshold->threshold());
+	if (sampleDiffs) {
+		Mat background = bgModel ? bgModel->acquire() : bg;
+		sampleDifferences(frame, background, blurSize);
+		if (bgModel) bgModel->release();
+	}
+	autoThreshold->update();
+	return mask;
+}
+
+/**
+ * Counts the differences of the whole (masked) frame for the automatic
+ * threshold at 1 / diffSampleFactor resolution, for when segment()
+ * only diffs part of it. Block averaging and a blurSize / factor blur
+ * stand in for the full resolution blur, like in coarseDetect().
+ */
+void Kmt::sampleDifferences(Mat frame, Mat background, int blurSize) {
+	int f = diffSampleFactor;
+	Rect sampled(0, 0, frame.cols / f * f, frame.rows / f * f);
+	if (sampled.area() == 0) return;
+
+	// Rebuilt whenever the adaptive background publishes a new one
+	if (background.data != sampleBgSource) {
+		resize(background(sampled), sampleBg, Size(), 1.0 / f, 1.0 / f, INTER_AREA);
+		sampleBgSource = background.data;
+	}
+	if (!outsideMask.empty() && sampleOutside.empty())
+		resize(outsideMask(sampled), sampleOutside, Size(), 1.0 / f, 1.0 / f, INTER_NEAREST);
+
+	Mat small;
+	resize(frame(sampled), small, Size(), 1.0 / f, 1.0 / f, INTER_AREA);
+	small = blur(small, (std::max)(1, blurSize / f));
+	cv::absdiff(small, sampleBg, small);
+
+	unsigned int* hist = autoThreshold->frameHistogram();
+	for (int y = 0; y < small.rows; y++) {
+		const tByte* d = small.ptr<tByte>(y);
+		const tByte* outside = sampleOutside.empty() ? nullptr : sampleOutside.ptr<tByte>(y);
+		for (int x = 0; x < small.cols; x++)
+			if (!outside || !outside[x])
+				hist[d[x]]++;
+	}
+}
+
+/**
+ * segment() with the threshold to use.
+ */
+Mat Kmt::segmentWindow(Mat frame, Rect& window, int blurSize, int thresholdValue) {
+	// Nothing to find outside the arena
+	if (!arenaMask.empty() && (window & arenaMask.bounds()).area() > 0)
+		window &= arenaMask.bounds();
+
+	if (graph) {
+		Mat background = bgModel ? bgModel->acquire() : bg;
+		Mat mask = graph->run(frame, window, background);
+		if (bgModel) bgModel->release();
+		return mask;
+	}
+
+	if (tileSize == 0) {
+		Mat background = bgModel ? bgModel->acquire() : bg;
+		if (pyramidFactor > 1) {
+			Rect patch = coarseDetect(frame, background, window, blurSize, thresholdValue);
+			if (patch.area() == 0) {
+				if (bgModel) bgModel->release();
+				return Mat::zeros(window.size(), CV_8U); // Nothing there, skip the full resolution pass
+			}
+			window = patch;
+		}
+		Mat mask = segmentRegion(frame, background, window, blurSize, thresholdValue);
+		if (bgModel) bgModel->release();
+		return mask;
+	}
+
+	if (!tiles || tileMask.size() != frame.size()) {
+		tiles.reset(new DirtyTiles(frame.size(), tileSize, tileChangeThreshold));
+		tileMask = Mat::zeros(frame.size(), CV_8U);
+	}
+	if (thresholdValue != tileThreshold) {
+		tiles->invalidate(); // Cached tiles were thresholded differently, e.g. --auto moved it
+		tileThreshold = thresholdValue;
+	}
+
+	Mat background = bgModel ? bgModel->acquire() : bg;
+	vector<Rect> runs = tiles->update(frame, floorLimit.empty() ? background : Mat(), window);
+	for (const Rect& run : runs)
+		segmentRegion(frame, background, run, blurSize, thresholdValue).copyTo(tileMask(run));
+	if (bgModel) bgModel->release();
+
+	tilesChanged = !runs.empty();
+	return tileMask(window).clone(); // findContours() may modify its input
+}
+
+/**
+ * Only reprocesses the parts of the frame that changed, see segment().
+ * Blob detection is skipped entirely while nothing did.
+ *
+ * args: tileSize: tile width and height (px), at least half the blur size
+ *		 changeThreshold: a pixel changed when it differs more than this
+ *						  from when its tile was last processed
+ */
+void Kmt::enableTiles(int tileSize, int changeThreshold) {
+	this->tileSize = tileSize;
+	tileChangeThreshold = changeThreshold;
+	tiles.reset();
+}
+
+/**
+ * Replaces the built-in segmentation (blur, diffThreshold()) by a
+ * configured chain of stages, see ProcessingGraph.
+ */
+void Kmt::setGraph(unique_ptr<ProcessingGraph> graph) {
+	this->graph = move(graph);
+}
+
+/**
+ * Selects the (global) threshold from the difference histogram while
+ * tracking, see AutoThreshold. Not used with setBgNoise() or a floor model.
+ *
+ * args: initial: threshold until enough differences were seen
+ */
+void Kmt::enableAutoThreshold(int initial) {
+	autoThreshold.reset(new AutoThreshold(initial));
+}
+
+/**
+ * returns: threshold segment() currently uses, -1 iff not automatic
+ */
+int Kmt::currentThreshold() const {
+	return autoThreshold ? autoThreshold->threshold() : -1;
+}
+
+/**
+ * Detects on a downsampled frame first, see segment(). The result
+ * agrees with the full resolution detector as long as the animal is
+ * found at the coarse level, which the minimum size is scaled down for.
+ *
+ * args: factor: downsampling factor, 2 or 4
+ *		 minimumSize: as passed to findPos()
+ */
+void Kmt::enablePyramid(int factor, float minimumSize) {
+	pyramidFactor = factor;
+	pyramidMinimumSize = minimumSize;
+	coarseBg.release();
+	coarseBgSource = nullptr;
+	coarseThresholdMap.release();
+	coarseLimit.release();
+}
+
+/**
+ * Finds the candidate blobs in a window at 1 / pyramidFactor
+ * resolution. The frame is downsampled by block averaging, a box
+ * filter and decimation in one pass, so only a blurSize / factor blur
+ * is left at the coarse level. Depth is decimated instead with a floor
+ * model, averaging would mix in the holes.
+ *
+ * returns: full resolution patch around the blob findPos() would
+ *			select (all candidates with multiple animals), empty for none
+ */
+Rect Kmt::coarseDetect(Mat frame, Mat background, Rect window, int blurSize, int thresholdValue) {
+	int f = pyramidFactor;
+	Rect coarse(window.x / f, window.y / f, window.width / f, window.height / f);
+	if (coarse.area() == 0) return window;
+
+	bool depth = !floorLimit.empty();
+	Mat small;
+	resize(frame(Rect(coarse.tl() * f, coarse.size() * f)), small, Size(), 1.0 / f, 1.0 / f, depth ? INTER_NEAREST : INTER_AREA);
+
+	Mat mask;
+	if (depth) {
+		if (coarseLimit.empty())
+			resize(floorLimit, coarseLimit, Size(), 1.0 / f, 1.0 / f, INTER_NEAREST);
+		closerThan(small, coarseLimit(coarse), mask);
+	} else {
+		// Rebuilt whenever the adaptive background publishes a new one
+		if (background.data != coarseBgSource) {
+			resize(background, coarseBg, Size(), 1.0 / f, 1.0 / f, INTER_AREA);
+			coarseBgSource = background.data;
+		}
+		if (!thresholdMap.empty() && coarseThresholdMap.empty())
+			resize(thresholdMap, coarseThresholdMap, Size(), 1.0 / f, 1.0 / f, INTER_AREA);
+
+		small = blur(small, (std::max)(1, blurSize / f));
+		if (!thresholdMap.empty()) {
+			diffThresholdMap(small, coarseBg(coarse), coarseThresholdMap(coarse), mask);
+		} else {
+			cv::absdiff(small, coarseBg(coarse), small);
+			threshold(small, mask, thresholdValue, 256, 0);
+		}
+	}
+
+	vector<Blob> blobs = findBlobs(mask, pyramidMinimumSize / f, coarse.tl());
+
+	// Same selection as findPos(), in full resolution coordinates
+	Rect patch;
+	float largest = 0;
+	for (const Blob& blob : blobs) {
+		if (multi) {
+			patch = patch.area() == 0 ? blob.bounds : patch | blob.bounds;
+			continue;
+		}
+		if (blob.radius <= largest || (predictive && !motion.gate(blob.center * (float)f)))
+			continue;
+		largest = blob.radius;
+		patch = blob.bounds;
+	}
+	if (patch.area() == 0) return Rect();
+
+	Point pad(pyramidPadding + 1, pyramidPadding + 1);
+	patch = Rect((patch.tl() - pad) * f, (patch.br() + pad) * f);
+	return patch & window;
+}
+
+/**
+ * Segments one region of the frame, the blur sees the pixels around it
+ * so regions can be stitched without seams.
+ */
+Mat Kmt::segmentRegion(Mat frame, Mat background, Rect region, int blurSize, int thresholdValue) {
+	Mat mask;
+	if (!floorLimit.empty()) {
+		closerThan(frame(region), floorLimit(region), mask);
+		return mask;
+	}
+
+	int margin = blurSize / 2;
+	Rect padded = Rect(region.x - margin, region.y - margin, region.width + 2 * margin, region.height + 2 * margin);
+	padded &= Rect(Point(0, 0), frame.size());
+	Mat blurred = blur(frame(padded), blurSize)(region - padded.tl());
+
+	return diffAgainst(blurred, background, thresholdValue, region);
+}
+
+/**
+ * Keeps learning the background while tracking, see BackgroundModel.
+ *
+ * pre: setBg() has been called
+ * args: blurSize: as used for tracking
+ *		 thresholdValue: as used for tracking
+ *		 learningShift: learning rate is 1 / 2^learningShift per update
+ */
+void Kmt::enableAdaptiveBg(int blurSize, int thresholdValue, int learningShift) {
+	bgModel.reset(new BackgroundModel(bg, blurSize, thresholdValue, learningShift));
+}
+
+/**
+ * Offers a raw frame to the adaptive background, if enabled. Doesn't block.
+ */
+void Kmt::learnBg(Mat frame) {
+	if (bgModel) bgModel->post(frame);
 }
 
 /**
@@ -48,118 +381,451 @@ Mat Kmt::blur(Mat frame, int blurSize) {
  *
  * pre: setBg() has been called
  * args: frame
- *		 thresholdValue: value for boolean threshold
+ *		 thresholdValue: value for boolean threshold, unused with setBgNoise()
+ *		 window: region of the background the frame was cut from, empty for the whole frame
  * returns: processed frame
  */
-Mat Kmt::diffThreshold(Mat frame, int thresholdValue) {
-	Mat temp = Mat();
-	cv::absdiff(frame, bg, temp);
-	threshold(temp, frame, thresholdValue, 256, 0);
+Mat Kmt::diffThreshold(Mat frame, int thresholdValue, Rect window) {
+	if (window.area() == 0)
+		window = Rect(Point(0, 0), frame.size());
+
+	Mat background = bgModel ? bgModel->acquire() : bg;
+	Mat mask = diffAgainst(frame, background, thresholdValue, window);
+	if (bgModel) bgModel->release();
+	return mask;
+}
 
-	return frame;
+/**
+ * diffThreshold() against the given (acquired) background, with an
+ * arena mask only the row spans inside the arena are visited.
+ */
+Mat Kmt::diffAgainst(Mat frame, Mat background, int thresholdValue, Rect window) {
+	Mat mask;
+	if (arenaMask.size() != background.size()) {
+		diffSpan(frame, background, thresholdValue, window, mask);
+		return mask;
+	}
+
+	mask = Mat::zeros(window.size(), CV_8U);
+	for (int y = window.y; y < window.y + window.height; y++) {
+		for (const RowSpan& span : arenaMask.row(y)) {
+			int begin = (std::max)(span.begin, window.x);
+			int end = (std::min)(span.end, window.x + window.width);
+			if (begin >= end) continue;
+
+			Rect region(begin, y, end - begin, 1);
+			Mat out = mask(region - window.tl());
+			diffSpan(frame(region - window.tl()), background, thresholdValue, region, out);
+		}
+	}
+
+	return mask;
 }
 
 /**
- * Finds and marks position of the mouse in the given frame
- * if no sufficiently large object is found the last known
- * position is returned.
+ * Diffs and thresholds one region of the frame into mask (allocated
+ * if empty, else written in place).
+ */
+void Kmt::diffSpan(Mat frame, Mat background, int thresholdValue, Rect region, Mat& mask) {
+	if (!thresholdMap.empty()) {
+		diffThresholdMap(frame, background(region), thresholdMap(region), mask);
+		return;
+	}
+
+	if (autoThreshold && !sampleDiffs) {
+		diffThresholdHist(frame, background(region), thresholdValue, mask, autoThreshold->frameHistogram());
+		return;
+	}
+
+	Mat temp = Mat();
+	cv::absdiff(frame, background(region), temp);
+	threshold(temp, mask, thresholdValue, 256, 0);
+}
+
+/**
+ * Finds the objects in a thresholded frame.
  *
  * args: frame
  *		 minimumSize: objects under this size (in px) will be ignored
- * returns: findPosOutput
- *			.frame: marked frame
- *			.x:		x-pos
- *			.y:		y-pos
+ *		 offset: position of the frame in the full (background sized) frame
+ * returns: blobs in full frame coordinates
  */
-findPosOutput Kmt::findPos(Mat frame, float minimumSize) {
+vector<Blob> Kmt::findBlobs(Mat frame, float minimumSize, Point offset) {
+	if (tiles && !tilesChanged && offset == cachedOffset && frame.size() == cachedSize)
+		return cachedBlobs;
+
 	vector<vector<Point>> contours;
 	vector<Vec4i> hierarchy;
 
-	findContours(frame, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, Point(0, 0));
+	findContours(frame, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, offset);
 
 	vector<Point> contoursPoly;
-	Point2f center;
-	float radius;
+	vector<Blob> blobs;
+
+	for (int i = 0; i < contours.size(); i++) {
+		Blob blob;
+		approxPolyDP(Mat(contours[i]), contoursPoly, 3, true);
+		minEnclosingCircle((Mat)contoursPoly, blob.center, blob.radius);
+
+		if (blob.radius < minimumSize)
+			continue;
+
+		// Area and shape come from the contour's moments, no extra pass over the pixels
+		Moments m = moments(contours[i]);
+		blob.area = m.m00;
+		setBlobShape(blob, m.mu20, m.mu11, m.mu02);
+		blob.bounds = boundingRect(contours[i]);
+		blob.contour = move(contours[i]);
+		blobs.push_back(move(blob));
+	}
+
+	if (tiles) {
+		cachedBlobs = blobs;
+		cachedOffset = offset;
+		cachedSize = frame.size();
+	}
+
+	return blobs;
+}
+
+/**
+ * Finds and marks position of the mouse in the given frame
+ * if no sufficiently large object is found the last known
+ * position is returned.
+ *
+ * With prediction enabled only objects that pass the motion
+ * model's gate are considered and the filtered position is
+ * returned, if none pass the predicted position is returned.
+ *
+ * The orientation of the selected object is kept when none is found.
+ *
+ * args: frame
+ *		 minimumSize: objects under this size (in px) will be ignored
+ *		 offset: position of the frame in the full (background sized) frame
+ * returns: findPosOutput
+ *			.overlay:	 marks, rendered on demand
+ *			.x:			 x-pos
+ *			.y:			 y-pos
+ *			.angle:		 body axis (deg)
+ *			.elongation: major / minor body axis length
+ *			.heading:	 head direction (deg)
+ */
+findPosOutput Kmt::findPos(Mat frame, float minimumSize, Point offset) {
+	vector<Blob> blobs = findBlobs(frame, minimumSize, offset);
 
 	float largestFoundRadius = 0;
+	Point2f prevPos = lastPos;
 	Point2f posLargest = lastPos; // If no sufficiently large object is found, default to last known pos
+	const Blob* selected = nullptr;
 
-	for (int i = 0; i < contours.size(); i++) {
-		approxPolyDP(Mat(contours[i]), contoursPoly, 3, true);
-		minEnclosingCircle((Mat)contoursPoly, center, radius);
+	for (const Blob& blob : blobs) {
+		if (blob.radius > largestFoundRadius) {
+			if (predictive && !motion.gate(blob.center))
+				continue; // Implausible jump, most likely noise or a reflection
 
-		if (radius >= minimumSize && radius > largestFoundRadius) {
-			largestFoundRadius = radius;
-			posLargest = center;
+			largestFoundRadius = blob.radius;
+			posLargest = blob.center;
 			lastPos = posLargest;
+			selected = &blob;
 		}
 	}
 
-	Mat colored = Mat();
-	cvtColor(frame, colored, cv::COLOR_GRAY2BGR);
+	if (predictive) {
+		if (largestFoundRadius > 0)
+			motion.correct(posLargest);
+		else
+			motion.coast();
+		posLargest = motion.position();
+	}
 
-	circle(colored, posLargest, 50, 0x0000FF, 2);
+	// A coasting prediction can leave the frame
+	Size fullSize = frameSize.area() > 0 ? frameSize : frame.size();
+	posLargest = clampToFrame(posLargest, fullSize);
+	lastPos = posLargest;
 
+	if (selected != nullptr) {
+		Point2f velocity = predictive ? motion.velocity() : lastDt > 0 ? (posLargest - prevPos) / lastDt : Point2f();
+		heading.update(*selected, velocity);
+	}
+
+	// Mark on a full size frame so the output size doesn't depend on the window
 	findPosOutput output;
-	output.frame = colored;
+	output.overlay = Overlay(frame, fullSize, offset, fullSize != frame.size());
+	output.overlay.mark(posLargest, 50, Scalar(0, 0, 255), 2, heading.heading());
 	output.x = (tWord)posLargest.x;
 	output.y = (tWord)posLargest.y;
+	output.angle = heading.angle();
+	output.elongation = heading.elongation();
+	output.heading = heading.heading();
 
 	return output;
 }
 
-Mat Kmt::getDepthMat() {
-	bool updated = kinect.updateMultiFrame(frameUpdateTimeout);
-	if (!updated) {
-		cout << "Skipping frame" << endl;
-		exit(1);
+/**
+ * Finds and marks the positions of all animals in the given frame,
+ * see enableMultiTracking(). Animals whose track is lost keep their
+ * last (predicted) position.
+ *
+ * pre: enableMultiTracking() has been called
+ * args: frame
+ *		 minimumSize: objects under this size (in px) will be ignored
+ *		 offset: position of the frame in the full (background sized) frame
+ * returns: findPosMultiOutput
+ *			.overlay:	 marks, rendered on demand
+ *			.x:			 x-pos per animal
+ *			.y:			 y-pos per animal
+ *			.angle:		 body axis (deg) per animal
+ *			.elongation: major / minor body axis length per animal
+ *			.heading:	 head direction (deg) per animal
+ */
+findPosMultiOutput Kmt::findPosMulti(Mat frame, float minimumSize, Point offset) {
+	multi->update(findBlobs(frame, minimumSize, offset), frame, offset);
+
+	static const Scalar trackColors[] = {
+		Scalar(0, 0, 255), Scalar(0, 255, 0), Scalar(255, 0, 0),
+		Scalar(0, 255, 255), Scalar(255, 0, 255), Scalar(255, 255, 0)
+	};
+
+	// Mark on a full size frame like findPos(), the output size doesn't depend on the window
+	Size fullSize = frameSize.area() > 0 ? frameSize : frame.size();
+	findPosMultiOutput output;
+	output.overlay = Overlay(frame, fullSize, offset, fullSize != frame.size());
+
+	for (int i = 0; i < multi->size(); i++) {
+		Point2f pos = clampToFrame(multi->position(i), fullSize);
+		output.x.push_back((tWord)pos.x);
+		output.y.push_back((tWord)pos.y);
+
+		const HeadingFilter& trackHeading = multi->heading(i);
+		output.angle.push_back(trackHeading.angle());
+		output.elongation.push_back(trackHeading.elongation());
+		output.heading.push_back(trackHeading.heading());
+
+		Scalar color = trackColors[i % 6];
+		output.overlay.mark(pos, 25, color, multi->isTracking(i) ? 2 : 1, trackHeading.heading());
 	}
 
-	tWord* depthFrameBuf = kinect.getDepthFrameBuf();
+	return output;
+}
 
-	Mat depthMat = depthBufToGrayscaleMat(depthFrameBuf);
+/**
+ * Enables predictive tracking: detections are gated against and
+ * smoothed by the given motion model, and predict() shrinks the
+ * processing window around the predicted position.
+ */
+void Kmt::enablePrediction(MotionModel model) {
+	motion = model;
+	predictive = true;
+}
+
+/**
+ * Enables multi-animal tracking: findPosMulti() follows the given
+ * number of animals, each with its own copy of the motion model.
+ */
+void Kmt::enableMultiTracking(int animals, MotionModel model) {
+	multi.reset(new MultiTracker(animals, model));
+}
+
+/**
+ * Advances the motion model(s) to the capture time of the next frame.
+ *
+ * args: t: capture time in ms
+ *		 frameSize: size of the full frame
+ * returns: window of the frame to process, the whole frame without
+ *			prediction and when tracking multiple animals
+ */
+Rect Kmt::predict(unsigned int t, Size frameSize) {
+	float dt = (t - lastT) / 1000.0f;
+	lastT = t;
+	lastDt = dt;
+	this->frameSize = frameSize;
+
+	if (multi) {
+		multi->predict(dt);
+		return Rect(Point(0, 0), frameSize);
+	}
+
+	if (!predictive)
+		return Rect(Point(0, 0), frameSize);
 
-	Rect frame(Point(45, 40), Point(475, 250)); // 512 * 424
-	Mat cropped = depthMat(frame);
+	motion.predict(dt);
 
-	return cropped;
+	return motion.searchWindow(frameSize, searchMargin);
+}
+
+Mat Kmt::getDepthMat() {
+	tWord* depthFrameBuf = nextDepthBuf();
+	lastDepthBuf = depthFrameBuf;
+
+	return depthBufToGrayscaleMat(depthFrameBuf, depthCrop);
 }
 
 Mat Kmt::getColorMat() {
 	tByte* buf;
 	try {
-		buf = kinect.getColorFrameBuf();
+		buf = kinect->getColorFrameBuf();
 	}
 	catch (NoFrameException) {
 		cout << "no frame" << endl;
 		throw;
 	}
-	Mat colorMat = colorFrameBufToGrayscaleMat(buf);
 
-	Rect frame(Point(400, 240), Point(1710, 850));
-	Mat cropped = colorMat(frame);
+	return colorFrameBufToGrayscaleMat(buf, colorCrop);
+}
+
+/**
+ * returns: the cropped raw depth frame (CV_16U, mm), see setDepthCrop()
+ */
+Mat Kmt::getRawDepthMat() {
+	tWord* depthFrameBuf = nextDepthBuf();
+	lastDepthBuf = depthFrameBuf;
+
+	Mat depthMat(KinectWrapper::cDepthHeight, KinectWrapper::cDepthWidth, CV_16U, depthFrameBuf);
+	return depthMat(depthCrop).clone();
+}
+
+/**
+ * Waits for the next depth frame of the sensor, or reads it from the
+ * replayed archive.
+ *
+ * returns: depth frame buffer (512 * 424)
+ * throws: EndOfReplayException iff the archive has no frames left
+ */
+tWord* Kmt::nextDepthBuf() {
+	if (replay) {
+		Mat frame;
+		if (!replay->read(frame, replayT))
+			throw EndOfReplayException();
+		frame.copyTo(replayDepth(Rect(replay->origin(), frame.size())));
+		return replayDepth.ptr<tWord>();
+	}
+
+	bool updated = kinect->updateMultiFrame(frameUpdateTimeout);
+	if (!updated) {
+		cout << "Skipping frame" << endl;
+		exit(1);
+	}
+	return kinect->getDepthFrameBuf();
+}
+
+/**
+ * Takes the depth frames from an archive written with --archive
+ * instead of the sensor, as fast as they are asked for. They are put
+ * back where they were in the sensor frame, so crops and arenas apply
+ * as they did live (pixels outside the archived crop have no depth).
+ * The crop is the archived one until setDepthCrop().
+ *
+ * args: fileName: depth archive, see DepthArchiveWriter
+ * throws: runtime_error iff it can't be read or doesn't fit the sensor frame
+ */
+void Kmt::enableReplay(string fileName) {
+	replay.reset(new DepthArchiveReader(fileName));
+	Rect region(replay->origin(), replay->size());
+	if ((region & Rect(0, 0, KinectWrapper::cDepthWidth, KinectWrapper::cDepthHeight)) != region)
+		throw runtime_error("Depth archive \"" + fileName + "\" doesn't fit in a depth frame");
+	replayDepth = Mat::zeros(KinectWrapper::cDepthHeight, KinectWrapper::cDepthWidth, CV_16U);
+	depthCrop = region; // Until another crop is set
+}
+
+/**
+ * returns: capture time (ms) of the last replayed frame, see enableReplay()
+ */
+unsigned Kmt::replayTime() const {
+	return replayT;
+}
+
+/**
+ * returns: the cropped raw depth (CV_16U, mm) of the frame the last
+ *			getDepthMat() or getRawDepthMat() captured, without copying
+ *			it, valid until the next capture, empty before the first
+ */
+Mat Kmt::lastRawDepthMat() {
+	if (!lastDepthBuf) return Mat();
+	Mat depthMat(KinectWrapper::cDepthHeight, KinectWrapper::cDepthWidth, CV_16U, lastDepthBuf);
+	return depthMat(depthCrop);
+}
+
+/**
+ * Restricts conversion and segmentation to the inside of the arena,
+ * see ArenaMask.
+ *
+ * args: mask: CV_8U, non-zero inside, the size of the (cropped) frame
+ *		 outside: frame the pixels outside are taken from during
+ *				  conversion (usually the background, so a blur across
+ *				  the arena's edge matches the background's), empty for 0
+ */
+void Kmt::setArenaMask(Mat mask, Mat outside) {
+	arenaMask = ArenaMask(mask);
+	outsideMask = mask == 0;
+	outsideFill = outside;
+	sampleOutside.release();
+	if (tiles) tiles->invalidate();
+}
 
-	return cropped;
+/**
+ * Fills pixels without a depth during conversion, see
+ * depthBufToGrayscaleMat(), so sensor holes don't show up as blobs.
+ *
+ * args: fill: frame to take them from (usually the background, same
+ *			   size as the crop), empty to interpolate from neighbours
+ */
+void Kmt::enableHoleFilling(Mat fill) {
+	fillHoles = true;
+	holeFill = fill;
 }
 
 /**
- * Converts the given color frame buffer (of size
- * 1920 * 1080 * 3) to a bgr Mat frame.
+ * Sets the region of the depth frame (512 * 424) getDepthMat() returns,
+ * pixels outside of it aren't converted.
+ *
+ * returns: crop as applied (clipped to the frame)
+ */
+Rect Kmt::setDepthCrop(Rect crop) {
+	depthCrop = crop & Rect(0, 0, KinectWrapper::cDepthWidth, KinectWrapper::cDepthHeight);
+	return depthCrop;
+}
+
+/**
+ * returns: region of the depth frame getDepthMat() returns
+ */
+Rect Kmt::getDepthCrop() const {
+	return depthCrop;
+}
+
+/**
+ * Sets the region of the color frame (1920 * 1080) getColorMat() returns,
+ * pixels outside of it aren't converted. The left edge is rounded down
+ * to an even column (YUYV pixel pair).
+ *
+ * returns: crop as applied (clipped to the frame and aligned)
+ */
+Rect Kmt::setColorCrop(Rect crop) {
+	crop &= Rect(0, 0, KinectWrapper::cColorWidth, KinectWrapper::cColorHeight);
+	crop.width += crop.x & 1;
+	crop.x &= ~1;
+	colorCrop = crop;
+	return colorCrop;
+}
+
+/**
+ * Converts the crop of the given color frame buffer (of size
+ * 1920 * 1080 * 2) to a grayscale Mat frame.
  *
  * args: buffer
+ *		 crop: region of the frame to convert, x even
  * returns: color frame
  */
-Mat Kmt::colorFrameBufToGrayscaleMat(tByte* buf) {
-	Mat yuv(1080, 1920, CV_8UC2, buf); // YUV color space
+Mat Kmt::colorFrameBufToGrayscaleMat(tByte* buf, Rect crop) {
+	Mat yuv(KinectWrapper::cColorHeight, KinectWrapper::cColorWidth, CV_8UC2, buf); // YUV color space
 
 	Mat bgr = Mat();
-	bgr.create(1080, 1920, CV_8UC3);
+	bgr.create(crop.size(), CV_8UC3);
 
-	cvtColor(yuv, bgr, CV_YUV2BGR_YUYV);
+	cvtColor(yuv(crop), bgr, CV_YUV2BGR_YUYV);
 
 	Mat channels[3];
 	split(bgr, channels);
-	channels[1] = Mat::zeros(1080, 1920, CV_8UC1);
+	channels[1] = Mat::zeros(crop.size(), CV_8UC1);
 	merge(channels, 3, bgr);
 
 	Mat gray = Mat();
@@ -169,25 +835,59 @@ Mat Kmt::colorFrameBufToGrayscaleMat(tByte* buf) {
 }
 
 /**
- * Converts the given depth frame buffer (of size
- * 650 * 135) to a depth Mat frame.
+ * Converts the crop of the given depth frame buffer (of size
+ * 512 * 424) to a depth Mat frame, depths in [650, 785) mm
+ * map to intensities [0, 135).
+ *
+ * With hole filling, pixels without a depth (0) are filled in the same
+ * pass instead of becoming 0: from the fill frame, so they don't differ
+ * from the background at all, or else from the last valid pixel to the
+ * left (above at the start of a span).
+ *
+ * With an arena mask only the pixels inside it are converted, the rest
+ * is copied from the outside fill (0 without one), see setArenaMask().
  *
  * args: buffer
+ *		 crop: region of the frame to convert
  * returns: depth frame
  */
-Mat Kmt::depthBufToGrayscaleMat(tWord* buf) {
+Mat Kmt::depthBufToGrayscaleMat(tWord* buf, Rect crop) {
 	short rangeMin = 650;
 	short rangeDelta = 135;
 
-	Mat mat = *new Mat();
-	mat.create(424, 512, CV_8U);
-	tByte* matPtr = mat.ptr<tByte>(0);
+	bool masked = arenaMask.size() == crop.size();
+	bool fromFill = fillHoles && holeFill.size() == crop.size();
 
-	for (int i = 0; i < 512 * 424; i++) {
-		tWord depth = *buf++;
-		tByte intensity = (depth >= rangeMin) && (depth < rangeMin + rangeDelta) ? depth - rangeMin : 0;
-		matPtr[i] = intensity;
+	// Outside the arena from the background, so blurring across the edge doesn't differ from it
+	Mat mat(crop.size(), CV_8U); // New every frame, the outputs may still hold the last one
+	if (masked) {
+		if (outsideFill.size() == crop.size())
+			outsideFill.copyTo(mat, outsideMask);
+		else
+			mat.setTo(Scalar::all(0), outsideMask);
+	}
+	vector<RowSpan> fullRow = { { 0, crop.width } };
+
+	for (int y = 0; y < crop.height; y++) {
+		const tWord* bufRow = buf + (crop.y + y) * KinectWrapper::cDepthWidth + crop.x;
+		tByte* matPtr = mat.ptr<tByte>(y);
+		const tByte* fillPtr = fromFill ? holeFill.ptr<tByte>(y) : nullptr;
+		const tByte* abovePtr = y > 0 ? mat.ptr<tByte>(y - 1) : nullptr;
+		for (const RowSpan& span : masked ? arenaMask.row(y) : fullRow) {
+			tByte last = 0;
+			for (int x = span.begin; x < span.end; x++) {
+				tWord depth = bufRow[x];
+				if (depth == 0 && fillHoles) {
+					matPtr[x] = fillPtr ? fillPtr[x] : x > span.begin || !abovePtr ? last : abovePtr[x];
+					last = matPtr[x];
+					continue;
+				}
+				tByte intensity = (depth >= rangeMin) && (depth < rangeMin + rangeDelta) ? depth - rangeMin : 0;
+				matPtr[x] = intensity;
+				last = intensity;
+			}
+		}
 	}
 
 	return mat;
-}
\ No newline at end of file
+}
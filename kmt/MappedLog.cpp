@@ -0,0 +1,185 @@
+// MappedLog.cpp - Crash-safe memory-mapped data log
+#include "MappedLog.h"
+
+// std
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+// win
+#include <Windows.h>
+
+static const char logMagic[4] = { 'K', 'M', 'T', 'L' };
+static const uint16_t logVersion = 1;
+
+// Header fields before the columns
+static const uint32_t rowsOffset = 16;
+static const uint32_t fixedHeaderSize = 24;
+
+static atomic<uint64_t>* rowCount(uint8_t* view) {
+	return reinterpret_cast<atomic<uint64_t>*>(view + rowsOffset);
+}
+
+/**
+ * args: fileName
+ *		 columns: values are stored as round(value * scale)
+ *		 capacity: rows preallocated, the file grows by doubling when full
+ * throws: runtime_error iff the file can't be created or mapped
+ */
+MappedLog::MappedLog(string fileName, vector<TrajectoryColumn> columns, uint64_t capacity) : columns(columns) {
+	recordSize = (uint32_t)(columns.size() * sizeof(int32_t));
+	uint32_t headerSize = fixedHeaderSize;
+	for (const TrajectoryColumn& column : columns)
+		headerSize += 4 + (uint32_t)column.name.size();
+	dataOffset = (headerSize + 63) / 64 * 64;
+
+	file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw runtime_error("Can't create data log \"" + fileName + "\"");
+	map(capacity);
+
+	memcpy(view, logMagic, 4);
+	uint8_t* p = view + 4;
+	auto put = [&p](const void* data, size_t bytes) {
+		memcpy(p, data, bytes);
+		p += bytes;
+	};
+	uint16_t count = (uint16_t)columns.size();
+	put(&logVersion, 2);
+	put(&count, 2);
+	put(&recordSize, 4);
+	put(&dataOffset, 4);
+	new (view + rowsOffset) atomic<uint64_t>(0);
+	p = view + fixedHeaderSize;
+	for (const TrajectoryColumn& column : columns) {
+		uint16_t scale = (uint16_t)column.scale, length = (uint16_t)column.name.size();
+		put(&scale, 2);
+		put(&length, 2);
+		put(column.name.data(), length);
+	}
+}
+
+MappedLog::~MappedLog() {
+	close();
+}
+
+/**
+ * Stores a row, one value per column. It is part of the log (survives
+ * a crash) once this returns.
+ *
+ * throws: runtime_error iff the log is full and can't grow
+ */
+void MappedLog::write(const vector<double>& row) {
+	if (!view) return;
+	if (rows == capacity) {
+		unmap();
+		map(capacity * 2);
+	}
+
+	int32_t* record = reinterpret_cast<int32_t*>(view + dataOffset + rows * recordSize);
+	for (size_t c = 0; c < columns.size(); c++)
+		record[c] = (int32_t)llround(row[c] * columns[c].scale);
+	rowCount(view)->store(++rows, memory_order_release);
+}
+
+/**
+ * Unmaps the log and truncates the file to the rows written, further
+ * rows are ignored.
+ */
+void MappedLog::close() {
+	if (file == INVALID_HANDLE_VALUE) return;
+	unmap();
+
+	LARGE_INTEGER size;
+	size.QuadPart = dataOffset + rows * recordSize;
+	SetFilePointerEx(file, size, nullptr, FILE_BEGIN);
+	SetEndOfFile(file);
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+}
+
+/**
+ * Extends the file to hold the given number of rows and maps it.
+ *
+ * throws: runtime_error iff that fails
+ */
+void MappedLog::map(uint64_t newCapacity) {
+	LARGE_INTEGER size;
+	size.QuadPart = dataOffset + newCapacity * recordSize;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(size.QuadPart >> 32), (DWORD)size.QuadPart, nullptr);
+	if (mapping)
+		view = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+	if (!view) {
+		if (mapping) CloseHandle(mapping);
+		mapping = nullptr;
+		throw runtime_error("Can't map data log (error " + to_string(GetLastError()) + ")");
+	}
+	capacity = newCapacity;
+}
+
+void MappedLog::unmap() {
+	if (view) UnmapViewOfFile(view);
+	if (mapping) CloseHandle(mapping);
+	view = nullptr;
+	mapping = nullptr;
+}
+
+/**
+ * Converts a data log, closed or not, to CSV as kmt writes it.
+ *
+ * throws: runtime_error iff either file can't be opened or the log is invalid
+ */
+void mappedLogToCsv(string fileName, string csvFileName) {
+	ifstream in(fileName, ios::binary);
+	if (!in.is_open())
+		throw runtime_error("Can't open data log \"" + fileName + "\"");
+
+	char magic[4];
+	uint16_t version, count;
+	uint32_t recordSize, dataOffset;
+	uint64_t rows;
+	in.read(magic, 4);
+	in.read(reinterpret_cast<char*>(&version), 2);
+	in.read(reinterpret_cast<char*>(&count), 2);
+	in.read(reinterpret_cast<char*>(&recordSize), 4);
+	in.read(reinterpret_cast<char*>(&dataOffset), 4);
+	in.read(reinterpret_cast<char*>(&rows), 8);
+	if (!in || memcmp(magic, logMagic, 4) != 0 || recordSize != count * sizeof(int32_t))
+		throw runtime_error("\"" + fileName + "\" is not a data log");
+	if (version != logVersion)
+		throw runtime_error("Unsupported data log version " + to_string(version));
+
+	vector<TrajectoryColumn> columns;
+	for (int c = 0; c < count; c++) {
+		uint16_t scale, length;
+		in.read(reinterpret_cast<char*>(&scale), 2);
+		in.read(reinterpret_cast<char*>(&length), 2);
+		string name(length, ' ');
+		in.read(&name[0], length);
+		columns.push_back({ name, scale });
+	}
+	if (!in)
+		throw runtime_error("Truncated data log header");
+
+	ofstream out(csvFileName);
+	if (!out.is_open())
+		throw runtime_error("Can't create \"" + csvFileName + "\"");
+	writeCsvHeader(out, columns);
+
+	in.seekg(dataOffset);
+	vector<int32_t> record(count);
+	vector<double> row(count);
+	for (uint64_t r = 0; r < rows; r++) {
+		if (!in.read(reinterpret_cast<char*>(record.data()), recordSize)) break;
+		for (int c = 0; c < count; c++)
+			row[c] = (double)record[c] / columns[c].scale;
+		writeCsvRow(out, columns, row);
+	}
+}
@@ -0,0 +1,70 @@
+// MedianBackground.cpp - Per pixel temporal median over many frames
+#include "MedianBackground.h"
+
+// std
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+using tWord = unsigned short;
+
+// Counts are 16-bit
+static const int maxFrames = 65535;
+
+MedianBackground::MedianBackground(Size size) : size(size), histograms((size_t)size.area() * bins, 0) {}
+
+/**
+ * Adds a frame (CV_8U, of the given size) to the histograms.
+ *
+ * throws: runtime_error iff the frame doesn't match or too many frames were added
+ */
+void MedianBackground::add(Mat frame) {
+	if (frame.size() != size || frame.type() != CV_8U)
+		throw runtime_error("Median background frame doesn't match the first frame");
+	if (added == maxFrames)
+		throw runtime_error("Median background can't take more than " + to_string(maxFrames) + " frames");
+
+	tWord* hist = histograms.data();
+	for (int y = 0; y < size.height; y++) {
+		const tByte* row = frame.ptr<tByte>(y);
+		for (int x = 0; x < size.width; x++, hist += bins)
+			hist[row[x] >> binShift]++;
+	}
+
+	added++;
+}
+
+int MedianBackground::count() const {
+	return added;
+}
+
+/**
+ * returns: per pixel median (CV_8U), interpolated within the median bin
+ */
+Mat MedianBackground::median() const {
+	Mat med(size, CV_8U);
+	float half = added / 2.0f;
+	const int binWidth = 1 << binShift;
+
+	const tWord* hist = histograms.data();
+	for (int y = 0; y < size.height; y++) {
+		tByte* row = med.ptr<tByte>(y);
+		for (int x = 0; x < size.width; x++, hist += bins) {
+			int below = 0;
+			int bin = 0;
+			while (bin < bins - 1 && below + hist[bin] < half)
+				below += hist[bin++];
+
+			float within = hist[bin] > 0 ? (half - below) / hist[bin] : 0.5f;
+			row[x] = saturate_cast<tByte>(bin * binWidth + within * binWidth);
+		}
+	}
+
+	return med;
+}
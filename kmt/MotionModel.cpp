@@ -0,0 +1,183 @@
+// MotionModel.cpp - Predictive (constant velocity Kalman) motion model
+#include "MotionModel.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Initial velocity variance ((px/s)^2), a mouse rarely exceeds ~500 px/s
+static const float initialVelocityVar = 250000;
+
+/**
+ * args: processNoise: white acceleration noise density ((px/s^2)^2 * s)
+ *		 measurementNoise: detection position variance (px^2)
+ *		 gateSigma: detections further than this many standard deviations
+ *					from the prediction are rejected
+ *		 maxCoast: frames without a detection before the track is considered lost
+ */
+MotionModel::MotionModel(float processNoise, float measurementNoise, float gateSigma, int maxCoast)
+	: processNoise(processNoise), measurementNoise(measurementNoise), gateSigma(gateSigma), maxCoast(maxCoast) {}
+
+/**
+ * (Re)starts the track at the given position with zero velocity.
+ */
+void MotionModel::reset(Point2f pos) {
+	x.reset(pos.x, measurementNoise, initialVelocityVar);
+	y.reset(pos.y, measurementNoise, initialVelocityVar);
+	lastCorrected = pos;
+	initialised = true;
+	coasted = 0;
+}
+
+/**
+ * Propagates the state dt seconds forward, a lost track stays put.
+ */
+void MotionModel::predict(float dt) {
+	if (!isTracking()) return;
+	x.predict(dt, processNoise);
+	y.predict(dt, processNoise);
+}
+
+/**
+ * Squared Mahalanobis distance between a detection and the prediction.
+ */
+float MotionModel::gateDistance(Point2f measurement) const {
+	float dx = measurement.x - x.p;
+	float dy = measurement.y - y.p;
+	return dx * dx / x.innovationVar(measurementNoise) + dy * dy / y.innovationVar(measurementNoise);
+}
+
+/**
+ * returns: largest accepted gateDistance()
+ */
+float MotionModel::gateLimit() const {
+	return gateSigma * gateSigma;
+}
+
+/**
+ * returns: true iff the detection is plausible given the prediction,
+ *			anything is plausible while the track is lost
+ */
+bool MotionModel::gate(Point2f measurement) const {
+	if (!isTracking()) return true;
+	return gateDistance(measurement) <= gateLimit();
+}
+
+/**
+ * Fuses a (gated) detection into the state.
+ */
+void MotionModel::correct(Point2f measurement) {
+	if (!isTracking()) {
+		reset(measurement);
+		return;
+	}
+	x.correct(measurement.x, measurementNoise);
+	y.correct(measurement.y, measurementNoise);
+	lastCorrected = position();
+	coasted = 0;
+}
+
+/**
+ * Registers a frame without a usable detection, the state keeps
+ * following the prediction while its uncertainty grows. Once the track
+ * is lost it stops extrapolating and falls back to the last corrected
+ * position.
+ */
+void MotionModel::coast() {
+	if (!initialised) return;
+	coasted++;
+	if (coasted == maxCoast + 1) {
+		x.p = lastCorrected.x;
+		y.p = lastCorrected.y;
+		x.v = y.v = 0;
+	}
+}
+
+bool MotionModel::isTracking() const {
+	return initialised && coasted <= maxCoast;
+}
+
+Point2f MotionModel::position() const {
+	return Point2f(x.p, y.p);
+}
+
+Point2f MotionModel::velocity() const {
+	return Point2f(x.v, y.v);
+}
+
+/**
+ * returns: standard deviation of the predicted detection (px) per axis
+ */
+Size2f MotionModel::uncertainty() const {
+	return Size2f(sqrt(x.innovationVar(measurementNoise)), sqrt(y.innovationVar(measurementNoise)));
+}
+
+/**
+ * Region of the frame that can contain a gated detection.
+ *
+ * args: frameSize
+ *		 margin: extra border in px (object radius + blur kernel)
+ * returns: window clipped to the frame, the whole frame while not tracking
+ */
+Rect MotionModel::searchWindow(Size frameSize, int margin) const {
+	Rect frame(Point(0, 0), frameSize);
+	if (!isTracking()) return frame;
+
+	Size2f sigma = uncertainty();
+	int halfW = (int)ceil(gateSigma * sigma.width) + margin;
+	int halfH = (int)ceil(gateSigma * sigma.height) + margin;
+	Point center((int)x.p, (int)y.p);
+
+	Rect window(center - Point(halfW, halfH), center + Point(halfW, halfH));
+	window &= frame;
+	return window.area() > 0 ? window : frame;
+}
+
+void MotionModel::Axis::reset(float pos, float posVar, float velVar) {
+	p = pos;
+	v = 0;
+	p00 = posVar;
+	p01 = 0;
+	p11 = velVar;
+}
+
+/**
+ * x = F x, P = F P F' + Q with F = [1 dt; 0 1] and Q the discretised
+ * white acceleration noise.
+ */
+void MotionModel::Axis::predict(float dt, float q) {
+	float dt2 = dt * dt;
+	float dt3 = dt2 * dt;
+
+	p += v * dt;
+
+	p00 += dt * (2 * p01 + dt * p11) + q * dt3 / 3;
+	p01 += dt * p11 + q * dt2 / 2;
+	p11 += q * dt;
+}
+
+/**
+ * Scalar measurement update with H = [1 0].
+ */
+void MotionModel::Axis::correct(float z, float r) {
+	float s = p00 + r;
+	float k0 = p00 / s;
+	float k1 = p01 / s;
+	float innovation = z - p;
+
+	p += k0 * innovation;
+	v += k1 * innovation;
+
+	p11 -= k1 * p01;
+	p01 -= k0 * p01;
+	p00 -= k0 * p00;
+}
+
+float MotionModel::Axis::innovationVar(float r) const {
+	return p00 + r;
+}
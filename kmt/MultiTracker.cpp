@@ -0,0 +1,355 @@
+// MultiTracker.cpp - Tracks several animals with stable identities
+#include "MultiTracker.h"
+
+// std
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Cost of an assignment outside the gate, never chosen over leaving a track unassigned
+static const float forbiddenCost = 1e6f;
+
+// A blob this many times the area of one animal is considered merged
+static const double mergedAreaFactor = 1.4;
+
+// Rounds of the prediction seeded k-means that splits a merged blob
+static const int splitIterations = 2;
+
+/**
+ * args: animals: number of animals (tracks) to keep
+ *		 model: motion model (noise, gate) every track starts from
+ */
+MultiTracker::MultiTracker(int animals, MotionModel model) : tracks(animals, model), headings(animals) {
+	gateCost = model.gateLimit();
+}
+
+/**
+ * Propagates all tracks dt seconds forward.
+ */
+void MultiTracker::predict(float dt) {
+	for (MotionModel& track : tracks)
+		track.predict(dt);
+}
+
+/**
+ * Assigns this frame's detections to the tracks.
+ *
+ * Tracks that are being followed get the minimum total cost
+ * assignment (each one can also stay unassigned at the cost of the
+ * gate), tracks that are lost or not yet started take the largest of
+ * the remaining detections. Only detections inside a gate are
+ * assigned, and tracks whose gates don't share any are solved
+ * separately, so noise blobs and distant animals don't grow the
+ * (cubic) assignment problem.
+ *
+ * args: blobs: detections, see Kmt::findBlobs()
+ *		 mask: thresholded frame the blobs were found in
+ *		 offset: position of the mask in the full frame
+ */
+void MultiTracker::update(vector<Blob> blobs, Mat mask, Point offset) {
+	blobs = splitMerged(blobs, mask, offset);
+
+	vector<int> active;
+	for (int i = 0; i < tracks.size(); i++)
+		if (tracks[i].isTracking()) active.push_back(i);
+
+	auto observeArea = [this](const Blob& blob) {
+		if (blob.contour.empty()) return; // Split part, area is only an estimate
+		if (singleArea == 0)
+			singleArea = blob.area;
+		else if (blob.area < mergedAreaFactor * singleArea)
+			singleArea = 0.95 * singleArea + 0.05 * blob.area;
+	};
+
+	// Gate first, detections outside every gate (noise) don't take part in the assignment
+	int n = (int)active.size();
+	int m = (int)blobs.size();
+	vector<vector<pair<int, float>>> gated(n); // Per active track: detection, cost
+	for (int r = 0; r < n; r++) {
+		for (int c = 0; c < m; c++) {
+			float d = tracks[active[r]].gateDistance(blobs[c].center);
+			if (d <= gateCost) gated[r].push_back({ c, d });
+		}
+	}
+
+	// Tracks and detections linked by their gates form independent clusters, nodes: tracks then detections
+	vector<int> parent(n + m);
+	iota(parent.begin(), parent.end(), 0);
+	function<int(int)> root = [&](int i) { return parent[i] == i ? i : parent[i] = root(parent[i]); };
+	for (int r = 0; r < n; r++)
+		for (const pair<int, float>& g : gated[r])
+			parent[root(r)] = root(n + g.first);
+
+	vector<vector<int>> clusterTracks(n + m), clusterBlobs(n + m);
+	for (int r = 0; r < n; r++)
+		if (!gated[r].empty()) clusterTracks[root(r)].push_back(r);
+	for (int c = 0; c < m; c++)
+		clusterBlobs[root(n + c)].push_back(c);
+
+	// Square cost matrix per cluster, rows: its tracks then one dummy per detection,
+	// cols: its detections then one dummy ("unassigned") per track
+	vector<int> match(n, -1);
+	vector<int> column(m); // Of a detection in its cluster's matrix
+	for (int k = 0; k < n + m; k++) {
+		const vector<int>& rows = clusterTracks[k];
+		const vector<int>& cols = clusterBlobs[k];
+		if (rows.empty()) continue;
+
+		int size = (int)(rows.size() + cols.size());
+		for (int c = 0; c < cols.size(); c++)
+			column[cols[c]] = c;
+		vector<vector<float>> cost(size, vector<float>(size, 0));
+		for (int r = 0; r < rows.size(); r++) {
+			fill(cost[r].begin(), cost[r].begin() + cols.size(), forbiddenCost);
+			fill(cost[r].begin() + cols.size(), cost[r].end(), gateCost);
+			for (const pair<int, float>& g : gated[rows[r]])
+				cost[r][column[g.first]] = g.second;
+		}
+
+		vector<int> assigned = assign(cost);
+		for (int r = 0; r < rows.size(); r++) {
+			int c = assigned[r];
+			if (c < cols.size() && cost[r][c] < forbiddenCost)
+				match[rows[r]] = cols[c];
+		}
+	}
+
+	vector<bool> used(m, false);
+	for (int r = 0; r < n; r++) {
+		int c = match[r];
+		MotionModel& track = tracks[active[r]];
+		if (c >= 0) {
+			track.correct(blobs[c].center);
+			headings[active[r]].update(blobs[c], track.velocity());
+			observeArea(blobs[c]);
+			used[c] = true;
+		} else {
+			track.coast();
+		}
+	}
+
+	// (Re)start lost tracks on the largest unassigned detections
+	vector<int> unused;
+	for (int c = 0; c < m; c++)
+		if (!used[c]) unused.push_back(c);
+	sort(unused.begin(), unused.end(), [&blobs](int a, int b) { return blobs[a].area > blobs[b].area; });
+
+	auto next = unused.begin();
+	for (int i = 0; i < tracks.size(); i++) {
+		MotionModel& track = tracks[i];
+		if (track.isTracking()) continue;
+		if (next != unused.end()) {
+			track.reset(blobs[*next].center);
+			headings[i].update(blobs[*next], track.velocity());
+			observeArea(blobs[*next]);
+			next++;
+		} else {
+			track.coast();
+		}
+	}
+}
+
+int MultiTracker::size() const {
+	return (int)tracks.size();
+}
+
+bool MultiTracker::isTracking(int i) const {
+	return tracks[i].isTracking();
+}
+
+Point2f MultiTracker::position(int i) const {
+	return tracks[i].position();
+}
+
+const HeadingFilter& MultiTracker::heading(int i) const {
+	return headings[i];
+}
+
+/**
+ * Splits blobs that contain the predictions of several tracks
+ * when there are fewer detections than tracks being followed.
+ */
+vector<Blob> MultiTracker::splitMerged(const vector<Blob>& blobs, Mat mask, Point offset) const {
+	int tracking = 0;
+	for (const MotionModel& track : tracks)
+		if (track.isTracking()) tracking++;
+
+	if (blobs.size() >= tracking)
+		return blobs;
+
+	vector<Blob> split;
+	for (const Blob& blob : blobs) {
+		vector<int> inside;
+		for (int i = 0; i < tracks.size(); i++)
+			if (tracks[i].isTracking() && norm(tracks[i].position() - blob.center) <= blob.radius)
+				inside.push_back(i);
+
+		bool large = singleArea == 0 || blob.area > mergedAreaFactor * singleArea;
+		if (inside.size() < 2 || !large) {
+			split.push_back(blob);
+			continue;
+		}
+
+		// Don't split into more parts than the area supports
+		if (singleArea > 0) {
+			int parts = std::max(2, (int)round(blob.area / singleArea));
+			if (parts < inside.size()) {
+				sort(inside.begin(), inside.end(), [this, &blob](int a, int b) {
+					return norm(tracks[a].position() - blob.center) < norm(tracks[b].position() - blob.center);
+				});
+				inside.resize(parts);
+			}
+		}
+
+		vector<Blob> parts = splitBlob(blob, inside, mask, offset);
+		split.insert(split.end(), parts.begin(), parts.end());
+	}
+
+	return split;
+}
+
+/**
+ * Splits a blob in one part per track with a k-means over its
+ * pixels, seeded with the tracks' predicted positions. Only the
+ * pixels inside the blob's bounding box are visited. The parts'
+ * shapes come from the second order moments gathered in the last
+ * round.
+ */
+vector<Blob> MultiTracker::splitBlob(const Blob& blob, const vector<int>& trackIds, Mat mask, Point offset) const {
+	int k = (int)trackIds.size();
+	Rect bounds = blob.bounds;
+	Rect local = (bounds - offset) & Rect(Point(0, 0), mask.size());
+	bounds = local + offset;
+
+	// Pixels of this contour only, other blobs can overlap the bounding box
+	Mat inside = Mat::zeros(local.size(), CV_8U);
+	vector<vector<Point>> contours = { blob.contour };
+	drawContours(inside, contours, 0, Scalar(255), FILLED, 8, noArray(), INT_MAX, Point(-bounds.x, -bounds.y));
+
+	vector<Point2f> seeds;
+	for (int id : trackIds)
+		seeds.push_back(tracks[id].position());
+
+	vector<int> count(k);
+	vector<double> sumXX(k), sumXY(k), sumYY(k);
+	for (int iteration = 0; iteration < splitIterations; iteration++) {
+		vector<double> sumX(k, 0), sumY(k, 0);
+		fill(count.begin(), count.end(), 0);
+		fill(sumXX.begin(), sumXX.end(), 0);
+		fill(sumXY.begin(), sumXY.end(), 0);
+		fill(sumYY.begin(), sumYY.end(), 0);
+
+		for (int y = 0; y < local.height; y++) {
+			const uchar* maskRow = mask.ptr<uchar>(local.y + y) + local.x;
+			const uchar* insideRow = inside.ptr<uchar>(y);
+			float py = (float)(bounds.y + y);
+			for (int x = 0; x < local.width; x++) {
+				if (!maskRow[x] || !insideRow[x]) continue;
+				float px = (float)(bounds.x + x);
+
+				int nearest = 0;
+				float nearestDist = FLT_MAX;
+				for (int j = 0; j < k; j++) {
+					float dx = px - seeds[j].x, dy = py - seeds[j].y;
+					float dist = dx * dx + dy * dy;
+					if (dist < nearestDist) {
+						nearestDist = dist;
+						nearest = j;
+					}
+				}
+				sumX[nearest] += px;
+				sumY[nearest] += py;
+				sumXX[nearest] += px * px;
+				sumXY[nearest] += px * py;
+				sumYY[nearest] += py * py;
+				count[nearest]++;
+			}
+		}
+
+		for (int j = 0; j < k; j++)
+			if (count[j] > 0) seeds[j] = Point2f((float)(sumX[j] / count[j]), (float)(sumY[j] / count[j]));
+	}
+
+	vector<Blob> parts;
+	for (int j = 0; j < k; j++) {
+		if (count[j] == 0) continue;
+		Blob part;
+		part.center = seeds[j];
+		part.area = count[j];
+		part.radius = (float)sqrt(count[j] / CV_PI);
+		part.bounds = bounds;
+
+		// Central moments from the raw sums, around the part's centroid
+		double cx = seeds[j].x, cy = seeds[j].y;
+		setBlobShape(part, sumXX[j] - count[j] * cx * cx, sumXY[j] - count[j] * cx * cy, sumYY[j] - count[j] * cy * cy);
+		parts.push_back(part);
+	}
+
+	return parts;
+}
+
+/**
+ * Minimum cost assignment (Hungarian algorithm, O(n^3)) on a square
+ * cost matrix.
+ *
+ * returns: column assigned to every row
+ */
+vector<int> MultiTracker::assign(const vector<vector<float>>& cost) {
+	int n = (int)cost.size();
+	vector<double> u(n + 1, 0), v(n + 1, 0);
+	vector<int> p(n + 1, 0), way(n + 1, 0);
+
+	for (int i = 1; i <= n; i++) {
+		p[0] = i;
+		int j0 = 0;
+		vector<double> minv(n + 1, DBL_MAX);
+		vector<bool> used(n + 1, false);
+		do {
+			used[j0] = true;
+			int i0 = p[j0], j1 = 0;
+			double delta = DBL_MAX;
+			for (int j = 1; j <= n; j++) {
+				if (used[j]) continue;
+				double cur = cost[i0 - 1][j - 1] - u[i0] - v[j];
+				if (cur < minv[j]) {
+					minv[j] = cur;
+					way[j] = j0;
+				}
+				if (minv[j] < delta) {
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+			for (int j = 0; j <= n; j++) {
+				if (used[j]) {
+					u[p[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minv[j] -= delta;
+				}
+			}
+			j0 = j1;
+		} while (p[j0] != 0);
+
+		do {
+			int j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0 != 0);
+	}
+
+	vector<int> rowToCol(n);
+	for (int j = 1; j <= n; j++)
+		rowToCol[p[j] - 1] = j - 1;
+	return rowToCol;
+}
@@ -0,0 +1,78 @@
+// Overlay.cpp - Lazily rendered marked frame
+#include "Overlay.h"
+
+// std
+#include <cmath>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Length of the heading line (px)
+static const float headingLength = 30;
+
+Overlay::Overlay() : outlineMask(false) {}
+
+/**
+ * args: mask: thresholded frame, kept by reference, not modified afterwards
+ *		 size: of the marked frame
+ *		 offset: position of the mask in the marked frame
+ *		 outlineMask: draw a rectangle around the mask
+ */
+Overlay::Overlay(Mat mask, Size size, Point offset, bool outlineMask)
+	: mask(mask), canvasSize(size), offset(offset), outlineMask(outlineMask) {}
+
+/**
+ * Adds a circle around a position (marked frame coordinates).
+ */
+void Overlay::mark(Point2f position, int radius, Scalar color, int thickness) {
+	marks.push_back({ position, radius, color, thickness, false, 0 });
+}
+
+/**
+ * Adds a circle around a position with a line in the heading (deg).
+ */
+void Overlay::mark(Point2f position, int radius, Scalar color, int thickness, float heading) {
+	marks.push_back({ position, radius, color, thickness, true, heading });
+}
+
+Size Overlay::size() const {
+	return canvasSize;
+}
+
+/**
+ * Draws the marked frame.
+ *
+ * args: out: CV_8UC3, reused when it already has size(), may be a view
+ */
+void Overlay::render(Mat& out) const {
+	out.create(canvasSize, CV_8UC3);
+	if (mask.size() == canvasSize) {
+		cvtColor(mask, out, cv::COLOR_GRAY2BGR);
+	} else {
+		out.setTo(Scalar::all(0));
+		Mat window = out(Rect(offset, mask.size()));
+		cvtColor(mask, window, cv::COLOR_GRAY2BGR);
+	}
+	if (outlineMask)
+		rectangle(out, Rect(offset, mask.size()), Scalar(0, 255, 0), 1);
+
+	for (const Mark& m : marks) {
+		circle(out, m.position, m.radius, m.color, m.thickness);
+		if (m.hasHeading) {
+			float rad = m.heading * (float)CV_PI / 180;
+			line(out, m.position, m.position + Point2f(cos(rad), sin(rad)) * headingLength, m.color, 2);
+		}
+	}
+}
+
+/**
+ * returns: the marked frame, CV_8UC3
+ */
+Mat Overlay::render() const {
+	Mat out;
+	render(out);
+	return out;
+}
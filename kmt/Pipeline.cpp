@@ -0,0 +1,51 @@
+// Pipeline.cpp - Frame sources and the fused templated segmentation kernel
+#include "Pipeline.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Typedef
+using tByte = unsigned char; // Random prefix t to avoid conflict
+using tWord = unsigned short;
+
+template<typename T>
+static bool specialised(const Mat& frame, Rect region, const Mat& bg, int blurSize, int threshold, Mat& mask) {
+	switch (blurSize) {
+		case 1: blurDiffThreshold<T, 1>(frame, region, bg, threshold, mask); break;
+		case 3: blurDiffThreshold<T, 3>(frame, region, bg, threshold, mask); break;
+		case 5: blurDiffThreshold<T, 5>(frame, region, bg, threshold, mask); break;
+		case 7: blurDiffThreshold<T, 7>(frame, region, bg, threshold, mask); break;
+		case 9: blurDiffThreshold<T, 9>(frame, region, bg, threshold, mask); break;
+		case 11: blurDiffThreshold<T, 11>(frame, region, bg, threshold, mask); break;
+		case 15: blurDiffThreshold<T, 15>(frame, region, bg, threshold, mask); break;
+		default: blurDiffThreshold<T, 0>(frame, region, bg, threshold, mask, blurSize); break;
+	}
+	return true;
+}
+
+/**
+ * blurDiffThreshold() specialised for the common blur sizes, the
+ * generic version for other odd ones.
+ *
+ * returns: false iff not supported (even blur size, other pixel types),
+ *			use the separate OpenCV stages then
+ */
+bool blurDiffThreshold(const Mat& frame, Rect region, const Mat& bg, int blurSize, int threshold, Mat& mask) {
+	if (blurSize % 2 == 0 || frame.type() != bg.type()) return false;
+	if (frame.type() == CV_8U) return specialised<tByte>(frame, region, bg, blurSize, threshold, mask);
+	if (frame.type() == CV_16U) return specialised<tWord>(frame, region, bg, blurSize, threshold, mask);
+	return false;
+}
+
+/**
+ * blurDiffThreshold() with the kernel size only known at run time, for
+ * comparison.
+ */
+bool blurDiffThresholdGeneric(const Mat& frame, Rect region, const Mat& bg, int blurSize, int threshold, Mat& mask) {
+	if (blurSize % 2 == 0 || frame.type() != bg.type()) return false;
+	if (frame.type() == CV_8U) blurDiffThreshold<tByte, 0>(frame, region, bg, threshold, mask, blurSize);
+	else if (frame.type() == CV_16U) blurDiffThreshold<tWord, 0>(frame, region, bg, threshold, mask, blurSize);
+	else return false;
+	return true;
+}
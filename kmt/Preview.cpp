@@ -0,0 +1,89 @@
+// Preview.cpp - Rate limited preview window on its own thread
+#include "Preview.h"
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Set in middle when it holds a frame the display hasn't taken
+static const int freshFlag = 4;
+
+/**
+ * args: windowName
+ *		 maxFps: frames shown per second at most
+ *		 scale: of the shown frame, 1 for full size
+ */
+Preview::Preview(string windowName, int maxFps, double scale)
+	: windowName(windowName), period(1000 / std::max(maxFps, 1)), scale(scale), middle(1), pressed(false), stopping(false) {
+	display = thread(&Preview::displayLoop, this);
+}
+
+Preview::~Preview() {
+	close();
+}
+
+/**
+ * Makes a frame the latest, replacing one that wasn't shown yet.
+ *
+ * args: render: draws the frame into its argument, on the display thread
+ */
+void Preview::publish(function<void(Mat&)> render) {
+	buffers[back] = move(render);
+	back = middle.exchange(back | freshFlag) & ~freshFlag;
+}
+
+/**
+ * returns: true once a key was pressed in the window
+ */
+bool Preview::keyPressed() const {
+	return pressed;
+}
+
+/**
+ * Stops the display thread and closes the window.
+ */
+void Preview::close() {
+	stopping = true;
+	if (display.joinable())
+		display.join();
+}
+
+/**
+ * Display thread: owns the window, shows the latest frame every period.
+ */
+void Preview::displayLoop() {
+	namedWindow(windowName, WINDOW_AUTOSIZE);
+
+	Mat frame, shown;
+	chrono::steady_clock::time_point next = chrono::steady_clock::now();
+	while (!stopping) {
+		if (middle.load() & freshFlag) {
+			front = middle.exchange(front) & ~freshFlag;
+			buffers[front](frame);
+			if (scale != 1) {
+				resize(frame, shown, Size(), scale, scale, INTER_AREA);
+				imshow(windowName, shown);
+			} else {
+				imshow(windowName, frame);
+			}
+		}
+
+		// Pumps the window's events for the rest of the period
+		next += period;
+		int wait = (int)chrono::duration_cast<chrono::milliseconds>(next - chrono::steady_clock::now()).count();
+		if (waitKey(std::max(wait, 1)) >= 0)
+			pressed = true;
+		if (wait < 0) next = chrono::steady_clock::now();
+	}
+
+	destroyWindow(windowName);
+}
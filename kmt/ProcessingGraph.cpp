@@ -0,0 +1,282 @@
+// ProcessingGraph.cpp - Segmentation chain configured from a file
+#include "ProcessingGraph.h"
+
+// Internal
+#include "TemporalFilter.h"
+#include "ThreadPool.h"
+
+// std
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Reads and plans a graph, see ProcessingGraph.
+ *
+ * throws: runtime_error iff the file can't be read or describes no valid graph
+ */
+ProcessingGraph::ProcessingGraph(string fileName) {
+	ifstream in(fileName);
+	if (!in.is_open())
+		throw runtime_error("Can't open processing graph file \"" + fileName + "\"");
+
+	static const map<string, StageType> types = {
+		{ "convert", convertStage }, { "temporal", temporalStage }, { "blur", blurStage }, { "bgdiff", bgdiffStage },
+		{ "threshold", thresholdStage }, { "morphology", morphologyStage }, { "and", andStage }, { "or", orStage },
+		{ "detect", detectStage }
+	};
+	static const map<StageType, int> inputCounts = {
+		{ convertStage, 0 }, { temporalStage, 1 }, { blurStage, 1 }, { bgdiffStage, 1 }, { thresholdStage, 1 },
+		{ morphologyStage, 1 }, { andStage, 2 }, { orStage, 2 }, { detectStage, 1 }
+	};
+
+	map<string, int> names;
+	string line;
+	int lineNr = 0;
+	while (getline(in, line)) {
+		lineNr++;
+		string where = fileName + ":" + to_string(lineNr) + ": ";
+		istringstream fields(line);
+		Stage stage;
+		string type;
+		if (!(fields >> stage.name) || stage.name[0] == '#')
+			continue; // Empty or comment
+		if (!(fields >> type) || !types.count(type))
+			throw runtime_error(where + "expected name type, type one of convert temporal blur bgdiff threshold morphology and or detect");
+		if (names.count(stage.name))
+			throw runtime_error(where + "stage \"" + stage.name + "\" defined twice");
+		stage.type = types.at(type);
+
+		string field;
+		while (fields >> field) {
+			size_t eq = field.find('=');
+			if (eq == string::npos) {
+				// Inputs
+				istringstream inputs(field);
+				string input;
+				while (getline(inputs, input, ',')) {
+					if (!names.count(input))
+						throw runtime_error(where + "unknown input \"" + input + "\", stages can only use earlier ones");
+					stage.inputs.push_back(names[input]);
+				}
+			} else if (field.substr(0, eq) == "op") {
+				stage.op = field.substr(eq + 1);
+			} else {
+				try {
+					stage.params[field.substr(0, eq)] = stoi(field.substr(eq + 1));
+				} catch (exception&) {
+					throw runtime_error(where + "expected a number in \"" + field + "\"");
+				}
+			}
+		}
+		if (stage.inputs.size() != inputCounts.at(stage.type))
+			throw runtime_error(where + type + " takes " + to_string(inputCounts.at(stage.type)) + " input(s)");
+
+		auto param = [&](string key, int defaultValue) {
+			return stage.params.count(key) ? stage.params[key] : defaultValue;
+		};
+		switch (stage.type) {
+			case temporalStage:
+				stage.filter = make_shared<TemporalFilter>(param("frames", 3));
+				break;
+			case blurStage:
+				if (param("size", 0) < 1) throw runtime_error(where + "blur needs size=N");
+				break;
+			case thresholdStage:
+				if (!stage.params.count("value")) throw runtime_error(where + "threshold needs value=N");
+				break;
+			case morphologyStage:
+				if (stage.op != "open" && stage.op != "close" && stage.op != "erode" && stage.op != "dilate")
+					throw runtime_error(where + "morphology needs op=open|close|erode|dilate");
+				stage.kernel = getStructuringElement(MORPH_ELLIPSE, Size(param("size", 3), param("size", 3)));
+				break;
+			case detectStage:
+				if (output >= 0) throw runtime_error(where + "only one detect stage allowed");
+				output = (int)stages.size();
+				break;
+			default:
+				break;
+		}
+
+		names[stage.name] = (int)stages.size();
+		stages.push_back(stage);
+	}
+
+	if (output < 0)
+		throw runtime_error("Processing graph \"" + fileName + "\" has no detect stage");
+
+	// The background is only blurred, so every bgdiff has to see the frame through the same blur
+	for (const Stage& stage : stages) {
+		if (stage.type != bgdiffStage) continue;
+		int size = 1;
+		for (int i = stage.inputs[0]; stages[i].type != convertStage; i = stages[i].inputs[0]) {
+			if (stages[i].type == blurStage && size == 1)
+				size = stages[i].params["size"];
+			else if (stages[i].type != temporalStage)
+				throw runtime_error("Processing graph \"" + fileName + "\": bgdiff " + stage.name + " can only follow convert, temporal and one blur, the background isn't processed otherwise");
+		}
+		if (bgBlur > 0 && size != bgBlur)
+			throw runtime_error("Processing graph \"" + fileName + "\": every bgdiff has to follow the same blur, there is one background");
+		bgBlur = size;
+	}
+
+	fuse();
+	schedule();
+}
+
+/**
+ * Segments a window of a frame.
+ *
+ * args: frame: full (converted) frame
+ *		 window: region to segment
+ *		 background: full background
+ * returns: mask of the detect stage, owned by the caller
+ */
+Mat ProcessingGraph::run(Mat frame, Rect window, Mat background) {
+	for (const vector<int>& level : levels) {
+		if (level.size() > 1 && pool) {
+			pool->parallelFor((int)level.size(), [&](int i) { runStage(level[i], frame, window, background); });
+		} else {
+			for (int i : level)
+				runStage(i, frame, window, background);
+		}
+	}
+
+	return results[output].clone(); // The stages' buffers are reused for the next frame
+}
+
+/**
+ * returns: size of the box blur in front of the bgdiff stage(s), the
+ *			background has to be blurred the same, 0 without a bgdiff
+ */
+int ProcessingGraph::bgBlurSize() const {
+	return bgBlur;
+}
+
+/**
+ * returns: the planned stages per level, for the log
+ */
+string ProcessingGraph::plan() const {
+	string description;
+	for (int l = 0; l < levels.size(); l++) {
+		description += to_string(l) + ":";
+		for (int i : levels[l]) {
+			const Stage& stage = stages[i];
+			description += " " + stage.name;
+			if (stage.type == fusedStage)
+				description += "(blur " + to_string(stage.blurSize) + " + bgdiff + threshold " + to_string(stage.thresholdValue) + ")";
+		}
+		description += "\n";
+	}
+	return description;
+}
+
+/**
+ * Replaces [blur ->] bgdiff -> threshold chains whose intermediate
+ * results have no other consumers by one fused stage.
+ */
+void ProcessingGraph::fuse() {
+	vector<int> consumers(stages.size(), 0);
+	for (const Stage& stage : stages)
+		for (int input : stage.inputs)
+			consumers[input]++;
+
+	for (Stage& stage : stages) {
+		if (stage.type != thresholdStage) continue;
+		int diff = stage.inputs[0];
+		if (stages[diff].type != bgdiffStage || consumers[diff] != 1) continue;
+
+		int source = stages[diff].inputs[0];
+		stage.blurSize = 1;
+		stages[diff].fused = true;
+		if (stages[source].type == blurStage && consumers[source] == 1 && stages[source].params["size"] % 2 == 1) {
+			stage.blurSize = stages[source].params["size"];
+			stages[source].fused = true;
+			source = stages[source].inputs[0];
+		}
+
+		stage.type = fusedStage;
+		stage.thresholdValue = stage.params["value"];
+		stage.inputs = { source };
+	}
+}
+
+/**
+ * Groups the remaining stages by depth, a stage only waits for the
+ * levels before it.
+ */
+void ProcessingGraph::schedule() {
+	vector<int> depth(stages.size(), 0);
+	int width = 1;
+	for (int i = 0; i < stages.size(); i++) {
+		if (stages[i].fused) continue;
+		for (int input : stages[i].inputs)
+			depth[i] = std::max(depth[i], depth[input] + 1);
+		if (depth[i] >= levels.size()) levels.resize(depth[i] + 1);
+		levels[depth[i]].push_back(i);
+		width = std::max(width, (int)levels[depth[i]].size());
+	}
+
+	results.resize(stages.size());
+	if (width > 1)
+		pool.reset(new ThreadPool(width - 1));
+}
+
+void ProcessingGraph::runStage(int i, Mat frame, Rect window, Mat background) {
+	Stage& stage = stages[i];
+	Mat in = stage.inputs.empty() ? Mat() : results[stage.inputs[0]];
+	Mat& out = results[i];
+
+	switch (stage.type) {
+		case convertStage:
+			out = frame(window);
+			break;
+		case temporalStage:
+			out = stage.filter->apply(in);
+			break;
+		case blurStage:
+			cv::blur(in, out, Size(stage.params["size"], stage.params["size"]));
+			break;
+		case bgdiffStage:
+			absdiff(in, background(window), out);
+			break;
+		case thresholdStage:
+			threshold(in, out, stage.params["value"], 255, THRESH_BINARY);
+			break;
+		case morphologyStage: {
+			int op = stage.op == "open" ? MORPH_OPEN : stage.op == "close" ? MORPH_CLOSE : stage.op == "erode" ? MORPH_ERODE : MORPH_DILATE;
+			morphologyEx(in, out, op, stage.kernel);
+			break;
+		}
+		case andStage:
+			bitwise_and(in, results[stage.inputs[1]], out);
+			break;
+		case orStage:
+			bitwise_or(in, results[stage.inputs[1]], out);
+			break;
+		case detectStage:
+			out = in;
+			break;
+		case fusedStage: {
+			// OpenCV's vectorised stages beat the scalar single pass (see blurDiffThreshold()), fusing saves the scheduling
+			Mat source = stages[stage.inputs[0]].type == convertStage ? frame(window) : in;
+			Mat blurred;
+			if (stage.blurSize > 1)
+				cv::blur(source, blurred, Size(stage.blurSize, stage.blurSize));
+			else
+				blurred = source;
+			absdiff(blurred, background(window), out);
+			threshold(out, out, stage.thresholdValue, 255, THRESH_BINARY);
+			break;
+		}
+	}
+}
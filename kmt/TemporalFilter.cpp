@@ -0,0 +1,50 @@
+// TemporalFilter.cpp - Per pixel temporal median of the last few frames
+#include "TemporalFilter.h"
+
+// Internal
+#include "Kernels.h"
+
+// std
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * args: frames: window length, 3 or 5
+ * throws: invalid_argument iff another length is asked for
+ */
+TemporalFilter::TemporalFilter(int frames) : ring(frames) {
+	if (frames != 3 && frames != 5)
+		throw invalid_argument("Temporal filter needs a window of 3 or 5 frames");
+}
+
+/**
+ * Adds a frame and filters it.
+ *
+ * args: frame: CV_8U or CV_16U
+ * returns: median of the last frames, the frame itself until the
+ *			window is full (or after a size change)
+ */
+Mat TemporalFilter::apply(Mat frame) {
+	Mat& slot = ring[next];
+	if (slot.size() != frame.size() || slot.type() != frame.type())
+		filled = 0; // Ring is reallocated slot by slot
+	frame.copyTo(slot);
+	next = (next + 1) % ring.size();
+
+	if (filled < ring.size()) filled++;
+	if (filled < ring.size())
+		return frame;
+
+	vector<const Mat*> frames;
+	for (const Mat& m : ring)
+		frames.push_back(&m);
+
+	Mat filtered;
+	temporalMedian(frames, filtered);
+	return filtered;
+}
@@ -0,0 +1,97 @@
+// ThreadPool.cpp - Fixed size pool of worker threads
+#include "ThreadPool.h"
+
+// std
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+ThreadPool::ThreadPool(int threads) {
+	threads = max(threads, 1);
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(&ThreadPool::work, this);
+}
+
+/**
+ * Finishes the queued tasks and joins the workers.
+ */
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> lock(tasksMutex);
+		stopping = true;
+	}
+	tasksChanged.notify_all();
+
+	for (thread& worker : workers)
+		worker.join();
+}
+
+/**
+ * Queues a task.
+ *
+ * returns: future that becomes ready (or holds the exception) when the task finished
+ */
+future<void> ThreadPool::submit(function<void()> task) {
+	packaged_task<void()> packaged(move(task));
+	future<void> done = packaged.get_future();
+	{
+		lock_guard<mutex> lock(tasksMutex);
+		tasks.push(move(packaged));
+	}
+	tasksChanged.notify_one();
+	return done;
+}
+
+/**
+ * Runs body(0) ... body(n - 1) on the pool, the calling thread takes
+ * the first one. Blocks until all are done, rethrows the first exception.
+ */
+void ThreadPool::parallelFor(int n, const function<void(int)>& body) {
+	vector<future<void>> done;
+	for (int i = 1; i < n; i++)
+		done.push_back(submit([&body, i]() { body(i); }));
+
+	// Wait for all before rethrowing, the tasks reference body
+	exception_ptr error;
+	if (n > 0) {
+		try {
+			body(0);
+		} catch (...) {
+			error = current_exception();
+		}
+	}
+
+	for (future<void>& f : done) {
+		try {
+			f.get();
+		} catch (...) {
+			if (!error) error = current_exception();
+		}
+	}
+
+	if (error) rethrow_exception(error);
+}
+
+int ThreadPool::size() const {
+	return (int)workers.size();
+}
+
+void ThreadPool::work() {
+	while (true) {
+		packaged_task<void()> task;
+		{
+			unique_lock<mutex> lock(tasksMutex);
+			tasksChanged.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return; // Stopping and nothing left to do
+			task = move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
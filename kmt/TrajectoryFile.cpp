@@ -0,0 +1,341 @@
+// TrajectoryFile.cpp - Compact binary trajectory (data) files
+#include "TrajectoryFile.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+static const char headerMagic[4] = { 'K', 'M', 'T', 'T' };
+static const char footerMagic[4] = { 'K', 'M', 'T', 'I' };
+static const uint16_t formatVersion = 1;
+
+// Size of the footer's trailer: u32 blocks, u64 footer offset, magic
+static const int trailerSize = 4 + 8 + 4;
+
+template<typename T>
+static void put(ostream& out, T value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static bool get(istream& in, T& value) {
+	return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+// Signed to unsigned so small magnitudes of either sign get short varints
+static uint64_t zigzag(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void putVarint(vector<uint8_t>& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+/**
+ * throws: runtime_error iff the varint runs past the end
+ */
+static uint64_t getVarint(const vector<uint8_t>& in, size_t& pos) {
+	uint64_t v = 0;
+	for (int shift = 0; pos < in.size(); shift += 7) {
+		uint8_t byte = in[pos++];
+		v |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return v;
+	}
+	throw runtime_error("Corrupt trajectory block");
+}
+
+/**
+ * args: fileName
+ *		 columns: the first one is the time (ms), used for seeking
+ *		 blockRows: rows per block (index granularity)
+ * throws: runtime_error iff the file can't be created
+ */
+TrajectoryWriter::TrajectoryWriter(string fileName, vector<TrajectoryColumn> columns, int blockRows)
+	: out(fileName, ios::binary | ios::trunc), columns(columns), blockRows(blockRows), previous(columns.size(), 0) {
+	if (!out.is_open())
+		throw runtime_error("Can't create trajectory file \"" + fileName + "\"");
+
+	out.write(headerMagic, 4);
+	put<uint16_t>(out, formatVersion);
+	put<uint16_t>(out, (uint16_t)columns.size());
+	for (const TrajectoryColumn& column : columns) {
+		put<uint16_t>(out, (uint16_t)column.scale);
+		put<uint16_t>(out, (uint16_t)column.name.size());
+		out.write(column.name.data(), column.name.size());
+	}
+
+	block.reserve(blockRows * columns.size() * 2);
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+	close();
+}
+
+/**
+ * Adds a row, one value per column.
+ */
+void TrajectoryWriter::write(const vector<double>& row) {
+	for (size_t c = 0; c < columns.size(); c++) {
+		int64_t value = llround(row[c] * columns[c].scale);
+		if (rows == 0 && c == 0)
+			index.push_back({ value, 0, 0 });
+		putVarint(block, zigzag(value - previous[c]));
+		previous[c] = value;
+	}
+
+	if (++rows == blockRows)
+		flushBlock();
+}
+
+/**
+ * Writes the last block and the footer. Further writes are ignored.
+ */
+void TrajectoryWriter::close() {
+	if (!out.is_open()) return;
+	flushBlock();
+
+	uint64_t footerOffset = out.tellp();
+	for (const TrajectoryBlock& entry : index) {
+		put<int64_t>(out, entry.firstT);
+		put<uint64_t>(out, entry.offset);
+		put<uint32_t>(out, entry.rows);
+	}
+	put<uint32_t>(out, (uint32_t)index.size());
+	put<uint64_t>(out, footerOffset);
+	out.write(footerMagic, 4);
+	out.close();
+}
+
+void TrajectoryWriter::flushBlock() {
+	if (rows == 0) return;
+
+	index.back().offset = out.tellp();
+	index.back().rows = rows;
+	put<uint32_t>(out, rows);
+	put<uint32_t>(out, (uint32_t)block.size());
+	out.write(reinterpret_cast<const char*>(block.data()), block.size());
+	out.flush(); // A crash loses at most the current block
+
+	block.clear();
+	rows = 0;
+	fill(previous.begin(), previous.end(), 0);
+}
+
+/**
+ * throws: runtime_error iff the file can't be read or isn't a trajectory file
+ */
+TrajectoryReader::TrajectoryReader(string fileName) : in(fileName, ios::binary) {
+	if (!in.is_open())
+		throw runtime_error("Can't open trajectory file \"" + fileName + "\"");
+
+	char magic[4];
+	uint16_t version, count;
+	if (!in.read(magic, 4) || memcmp(magic, headerMagic, 4) != 0 || !get(in, version) || !get(in, count))
+		throw runtime_error("\"" + fileName + "\" is not a trajectory file");
+	if (version != formatVersion)
+		throw runtime_error("Unsupported trajectory file version " + to_string(version));
+
+	for (int c = 0; c < count; c++) {
+		uint16_t scale, length;
+		get(in, scale);
+		get(in, length);
+		string name(length, ' ');
+		in.read(&name[0], length);
+		cols.push_back({ name, scale });
+	}
+	if (!in)
+		throw runtime_error("Truncated trajectory file header");
+	previous.resize(cols.size());
+
+	// Footer, or find the blocks of a file that wasn't closed
+	uint64_t dataStart = in.tellg();
+	in.seekg(0, ios::end);
+	uint64_t size = in.tellg();
+	uint32_t blocks = 0;
+	uint64_t footerOffset = 0;
+	bool indexed = false;
+	if (size >= dataStart + trailerSize) {
+		in.seekg(size - trailerSize);
+		get(in, blocks);
+		get(in, footerOffset);
+		in.read(magic, 4);
+		indexed = in && memcmp(magic, footerMagic, 4) == 0 && footerOffset + blocks * 20ull + trailerSize == size;
+	}
+
+	if (indexed) {
+		in.seekg(footerOffset);
+		index.resize(blocks);
+		for (TrajectoryBlock& entry : index) {
+			get(in, entry.firstT);
+			get(in, entry.offset);
+			get(in, entry.rows);
+		}
+	} else {
+		in.clear();
+		in.seekg(dataStart);
+		scanBlocks();
+	}
+
+	loadBlock(0);
+}
+
+const vector<TrajectoryColumn>& TrajectoryReader::columns() const {
+	return cols;
+}
+
+/**
+ * returns: total number of rows
+ */
+uint64_t TrajectoryReader::rows() const {
+	uint64_t total = 0;
+	for (const TrajectoryBlock& entry : index)
+		total += entry.rows;
+	return total;
+}
+
+/**
+ * Reads the next row.
+ *
+ * args: row: output, one value per column
+ * returns: false at the end
+ */
+bool TrajectoryReader::next(vector<double>& row) {
+	if (hasPending) {
+		row = pending;
+		hasPending = false;
+		return true;
+	}
+
+	while (remaining == 0)
+		if (!loadBlock(current + 1)) return false;
+
+	row.resize(cols.size());
+	for (size_t c = 0; c < cols.size(); c++) {
+		previous[c] += unzigzag(getVarint(block, position));
+		row[c] = (double)previous[c] / cols[c].scale;
+	}
+	remaining--;
+	return true;
+}
+
+/**
+ * Moves to the first row at or after the given time, only the block
+ * containing it is decoded.
+ *
+ * args: t: value of the first column
+ */
+void TrajectoryReader::seek(double t) {
+	hasPending = false;
+	if (index.empty()) return;
+
+	int64_t target = llround(t * cols[0].scale);
+	auto after = upper_bound(index.begin(), index.end(), target, [](int64_t v, const TrajectoryBlock& entry) { return v < entry.firstT; });
+	loadBlock(after == index.begin() ? 0 : after - index.begin() - 1);
+
+	while (next(pending)) {
+		if (pending[0] * cols[0].scale >= target) {
+			hasPending = true;
+			return;
+		}
+	}
+}
+
+/**
+ * Reads block i into memory.
+ *
+ * returns: false iff there is no such block
+ */
+bool TrajectoryReader::loadBlock(size_t i) {
+	current = i;
+	remaining = 0;
+	if (i >= index.size()) return false;
+
+	in.clear();
+	in.seekg(index[i].offset);
+	uint32_t rows, bytes;
+	if (!get(in, rows) || !get(in, bytes))
+		throw runtime_error("Truncated trajectory block");
+	block.resize(bytes);
+	if (!in.read(reinterpret_cast<char*>(block.data()), bytes))
+		throw runtime_error("Truncated trajectory block");
+
+	position = 0;
+	remaining = rows;
+	fill(previous.begin(), previous.end(), 0);
+	return true;
+}
+
+/**
+ * Builds the index by walking the blocks, stops at the first
+ * incomplete one.
+ */
+void TrajectoryReader::scanBlocks() {
+	while (true) {
+		uint64_t offset = in.tellg();
+		uint32_t rows, bytes;
+		if (!get(in, rows) || !get(in, bytes)) break;
+		block.resize(bytes);
+		if (!in.read(reinterpret_cast<char*>(block.data()), bytes) || rows == 0) break;
+
+		size_t pos = 0;
+		index.push_back({ unzigzag(getVarint(block, pos)), offset, rows });
+	}
+	in.clear();
+}
+
+/**
+ * Writes the CSV header line of the columns.
+ */
+void writeCsvHeader(ostream& out, const vector<TrajectoryColumn>& columns) {
+	for (size_t c = 0; c < columns.size(); c++)
+		out << (c > 0 ? "," : "") << columns[c].name;
+	out << "\n";
+}
+
+/**
+ * Writes a CSV row, integers for columns with scale 1 and one
+ * decimal per factor 10 of the scale otherwise.
+ */
+void writeCsvRow(ostream& out, const vector<TrajectoryColumn>& columns, const vector<double>& row) {
+	for (size_t c = 0; c < columns.size(); c++) {
+		if (c > 0) out << ",";
+		if (columns[c].scale == 1)
+			out << llround(row[c]);
+		else
+			out << fixed << setprecision((int)ceil(log10(columns[c].scale))) << row[c];
+	}
+	out << "\n";
+}
+
+/**
+ * Converts a binary trajectory file to CSV, as kmt writes it.
+ *
+ * throws: runtime_error iff either file can't be opened
+ */
+void trajectoryToCsv(string fileName, string csvFileName) {
+	TrajectoryReader reader(fileName);
+	ofstream out(csvFileName);
+	if (!out.is_open())
+		throw runtime_error("Can't create \"" + csvFileName + "\"");
+
+	writeCsvHeader(out, reader.columns());
+	vector<double> row;
+	while (reader.next(row))
+		writeCsvRow(out, reader.columns(), row);
+}
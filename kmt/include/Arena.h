@@ -0,0 +1,32 @@
+// Arena.h - Arena regions tracked independently in one frame
+#pragma once
+
+// std
+#include <string>
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * One arena of an arena config file. Every non-empty line that
+ * doesn't start with # describes one arena:
+ *
+ *   name x y width height [threshold] [datafile]
+ *
+ * with the region in sensor (uncropped) frame coordinates. Each
+ * arena's background is stored as bg_<name>.bmp.
+ */
+struct ArenaConfig {
+	string name;
+	Rect region;
+	int thresholdValue;
+	string dataFileName;
+	string bgFileName;
+};
+
+vector<ArenaConfig> loadArenaConfig(string fileName, int defaultThreshold);
+Rect arenaBounds(const vector<ArenaConfig>& arenas);
+Rect parseCrop(string spec);
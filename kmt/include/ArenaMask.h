@@ -0,0 +1,39 @@
+// ArenaMask.h - Region of the frame inside the arena, as row spans
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Run of pixels [begin, end) on one row
+struct RowSpan {
+	int begin;
+	int end;
+};
+
+/**
+ * Pixels inside the arena (e.g. a round one within its bounding
+ * rectangle), run-length encoded per row so per pixel stages can loop
+ * over the spans and never touch the corners.
+ */
+class ArenaMask {
+public:
+	ArenaMask();
+	ArenaMask(Mat mask);
+
+	bool empty() const;
+	Size size() const;
+	Rect bounds() const;
+	const vector<RowSpan>& row(int y) const;
+
+	static Mat detect(Mat bg);
+
+private:
+	Size frameSize;
+	Rect boundingBox;
+	vector<vector<RowSpan>> rows;
+};
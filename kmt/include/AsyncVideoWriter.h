@@ -0,0 +1,109 @@
+// AsyncVideoWriter.h - Video encoding on a dedicated thread
+#pragma once
+
+// std
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "CsvWriter.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// What write() does when the queue is full
+enum QueuePolicy {
+	blockPolicy,	// Wait for the encoder
+	dropPolicy,		// Skip the frame
+	spillPolicy		// Append the raw frame to a file, encoded once the encoder catches up
+};
+
+struct VideoStats {
+	unsigned frames = 0;		// Encoded, with repeats
+	unsigned repeated = 0;		// Extra copies to fill the timeline
+	unsigned skipped = 0;		// Captured faster than the video's rate
+	unsigned dropped = 0;		// Queue full
+	unsigned spilled = 0;
+	int depth = 0;				// Frames waiting now
+	int maxDepth = 0;
+	double meanLatency = 0;		// From write() to encoded (ms)
+	double maxLatency = 0;
+};
+
+/**
+ * Writes video frames from a dedicated encoder thread. Frames are
+ * queued as a function that draws them into one of a fixed number of
+ * preallocated slots, called on the encoder thread, so the tracking
+ * loop doesn't even pay for the copy or the rendering of a marked
+ * frame.
+ *
+ * Frames are placed on the video's fixed timeline by their capture
+ * time: a frame is repeated for every output frame whose time it is
+ * nearest to, and skipped when there is none, so video time stays
+ * capture time however fast the loop runs. An optional index (CSV:
+ * video frame, data row, capture time) maps every output frame back to
+ * the data.
+ */
+class AsyncVideoWriter {
+public:
+	AsyncVideoWriter(string fileName, int fourcc, double fps, Size size, int type, int queueSize = 8, QueuePolicy policy = blockPolicy, string indexFileName = "");
+	~AsyncVideoWriter();
+
+	void write(Mat frame, unsigned t, unsigned row);
+	void write(function<void(Mat&)> render, unsigned t, unsigned row);
+	void close();
+	VideoStats stats();
+
+private:
+	using Clock = chrono::steady_clock;
+
+	struct Queued {
+		Clock::time_point time;
+		int repeat;	// Output frames
+	};
+
+	struct Slot {
+		Mat frame;
+		function<void(Mat&)> render; // Draws frame, on the encoder thread
+		Queued queued;
+	};
+
+	void encodeLoop();
+
+	VideoWriter writer;
+	double fps;
+	QueuePolicy policy;
+	unique_ptr<CsvWriter> index;
+	unsigned firstT = 0;
+	uint64_t placed = 0;	// Output frames queued (timeline position)
+
+	vector<Slot> slots;		// Ring
+	size_t head = 0;		// Next to encode
+	size_t count = 0;		// Queued in the ring
+
+	string spillFileName;
+	ofstream spillOut;
+	ifstream spillIn;
+	vector<Queued> spillQueued;
+	size_t spillHead = 0;	// Next spilled frame to encode
+
+	VideoStats statistics;
+	double totalLatency = 0;
+	unsigned encoded = 0;	// Queued frames, for the mean latency
+	bool stopping = false;
+	mutex queueMutex;
+	condition_variable queueChanged;
+	thread encoder;
+};
+
+QueuePolicy parseQueuePolicy(string name);
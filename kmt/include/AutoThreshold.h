@@ -0,0 +1,36 @@
+// AutoThreshold.h - Threshold selection from the background difference histogram
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+/**
+ * Picks the difference threshold for the session instead of a value
+ * tuned by hand per rig.
+ *
+ * The diff kernel counts the differences of every frame (see
+ * diffThresholdHist()), they are added to a slowly decaying running
+ * histogram. Almost all pixels are background, so it is one noise peak
+ * near 0 with a long tail (the animal, edges): the threshold is the
+ * valley where the tail leaves the peak, found with the triangle
+ * method. It only moves when the new choice differs by more than the
+ * hysteresis, so it doesn't jitter from frame to frame.
+ */
+class AutoThreshold {
+public:
+	AutoThreshold(int initial, int hysteresis = 3, int minThreshold = 5);
+
+	unsigned int* frameHistogram();
+	bool update();
+	int threshold() const;
+
+private:
+	int select() const;
+
+	int current;
+	int hysteresis;
+	int minThreshold;
+	vector<unsigned int> frameHist; // Counts of the current frame
+	vector<double> running;			// Decayed sum over frames
+};
@@ -0,0 +1,60 @@
+// BackgroundModel.h - Adaptive (running average) background
+#pragma once
+
+// std
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Background that keeps learning while tracking.
+ *
+ * Every updateInterval-th posted frame is blurred and averaged into a
+ * per pixel 8.8 fixed point running average on a worker thread, except
+ * where it differs from the background (the animal and its
+ * surroundings). The 8-bit result is published through a lock-free
+ * double buffer: the reader pins the front buffer, the worker only ever
+ * writes the other one and then swaps.
+ *
+ * When most of the frame changes for several updates in a row (lights,
+ * moved camera) the background is relearned from scratch.
+ */
+class BackgroundModel {
+public:
+	BackgroundModel(Mat initial, int blurSize, int thresholdValue, int learningShift = 6, int updateInterval = 5);
+	~BackgroundModel();
+
+	Mat acquire();
+	void release();
+	void post(Mat frame);
+
+private:
+	void work();
+	void update(Mat frame);
+	void publish();
+
+	int blurSize;
+	int thresholdValue;
+	int learningShift;		// Learning rate is 1 / 2^learningShift per update
+	int updateInterval;
+	int posted = 0;
+	int changedUpdates = 0; // Consecutive updates with a scene change
+
+	Mat accumulator;		// CV_16U, 8.8 fixed point
+	Mat buffers[2];			// CV_8U, published background
+	atomic<int> front;		// Buffer the reader gets
+	atomic<int> pinned;		// Buffer the reader is using, -1 for none
+
+	thread worker;
+	mutex jobMutex;
+	condition_variable jobPosted;
+	Mat job;				// Frame waiting for the worker, empty for none
+	bool busy = false;
+	bool stopping = false;
+};
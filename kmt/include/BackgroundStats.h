@@ -0,0 +1,37 @@
+// BackgroundStats.h - Per pixel background mean and noise
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Per pixel mean and variance of (blurred) background frames, with
+ * Welford's running update. Samples that differ from the running mean
+ * by more than the global threshold are the animal and are skipped, so
+ * it may be in the arena while learning.
+ */
+class BackgroundStats {
+public:
+	BackgroundStats(Size size, int thresholdValue, int warmupFrames = 30);
+
+	void add(Mat frame);
+	int count() const;
+	Mat mean() const;
+	Mat sd() const;
+
+	static Mat thresholdMap(Mat sd, float sigmas, int minimum = 0);
+
+private:
+	Size size;
+	int thresholdValue;
+	int warmupFrames;
+	int added = 0;
+	vector<float> means;
+	vector<float> m2s;				 // Sum of squared deviations
+	vector<unsigned short> counts;
+};
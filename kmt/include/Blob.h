@@ -0,0 +1,20 @@
+// Blob.h - Detected object in a thresholded frame
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+struct Blob {
+	Point2f center;		  // Enclosing circle center (px, full frame)
+	float radius = 0;	  // Enclosing circle radius (px)
+	double area = 0;	  // Area (px^2)
+	Rect bounds;		  // Bounding box (full frame)
+	float angle = 0;	  // Major axis (rad, clockwise from x), [-pi/2, pi/2]
+	float elongation = 1; // Major / minor axis length
+	vector<Point> contour; // Outer contour (full frame), empty for split parts
+};
@@ -0,0 +1,51 @@
+// CsvWriter.h - Asynchronous buffered CSV data file writer
+#pragma once
+
+// std
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "TrajectoryFile.h"
+
+/**
+ * Writes CSV rows without touching iostreams on the calling thread.
+ * Rows are formatted straight into a large buffer (integers and fixed
+ * point, no allocation or locale), a background thread swaps it with
+ * a second one and writes it to disk every flush interval, or earlier
+ * when it fills up. write() only blocks when the disk can't keep up.
+ *
+ * The output matches writeCsvRow().
+ */
+class CsvWriter {
+public:
+	CsvWriter(string fileName, vector<TrajectoryColumn> columns, int flushInterval = 1000, size_t bufferSize = 1 << 20);
+	~CsvWriter();
+
+	void write(const vector<double>& row);
+	void close();
+
+private:
+	void flushLoop();
+
+	ofstream out;
+	vector<TrajectoryColumn> columns;
+	vector<int> decimals;	// Per column
+	size_t rowLimit;		// Longest possible formatted row
+	chrono::milliseconds flushInterval;
+
+	vector<char> active;	// Being filled
+	size_t used = 0;		// Of active
+	vector<char> writing;	// Being written by the flush thread
+	bool full = false;
+	bool stopping = false;
+	mutex bufferMutex;
+	condition_variable bufferChanged;
+	thread flusher;
+};
@@ -0,0 +1,88 @@
+// DepthArchive.h - Lossless compressed archive of raw 16-bit depth frames
+#pragma once
+
+// std
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "ThreadPool.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Writes raw depth frames (CV_16U) losslessly. Every pixel is
+ * predicted from the previous frame (from its left or upper neighbour
+ * in key frames), the residuals are zigzag coded and bit packed in
+ * groups of 16 with the width of the largest. The static background
+ * of a depth stream leaves only sensor noise, a few bits per pixel.
+ *
+ * Frames are cut in horizontal strips that are compressed
+ * independently on a thread pool, and several frames are in flight at
+ * once, write() only copies the frame.
+ *
+ * Layout (little endian):
+ *   header: "KMTD" u16 version u16 width u16 height u16 strips
+ *			 u16 x u16 y (of the frames in the sensor frame, version 2)
+ *   frame:  u32 t (ms) u8 key, per strip u32 bytes, strip payloads
+ */
+class DepthArchiveWriter {
+public:
+	DepthArchiveWriter(string fileName, Rect region, int threads = thread::hardware_concurrency(), int keyInterval = 300);
+	~DepthArchiveWriter();
+
+	void write(Mat depth, unsigned t);
+	void close();
+	uint64_t bytesWritten() const;
+
+private:
+	void writeReady(bool wait);
+
+	ofstream out;
+	Size size;
+	int strips;
+	int keyInterval;
+	unique_ptr<ThreadPool> pool;
+	Mat previous;
+	unsigned frames = 0;
+	uint64_t bytes = 0;
+
+	struct Pending {
+		unsigned t;
+		bool key;
+		shared_ptr<vector<vector<uint8_t>>> payloads;	// Per strip
+		vector<future<void>> done;
+	};
+	deque<Pending> pending;	// In write order
+};
+
+/**
+ * Reads an archive written by DepthArchiveWriter, decompressing the
+ * strips of a frame in parallel.
+ */
+class DepthArchiveReader {
+public:
+	DepthArchiveReader(string fileName, int threads = thread::hardware_concurrency());
+
+	Size size() const;
+	Point origin() const;
+	bool read(Mat& depth, unsigned& t);
+
+private:
+	ifstream in;
+	Size frameSize;
+	Point frameOrigin;
+	int strips;
+	unique_ptr<ThreadPool> pool;
+	Mat previous;
+	vector<vector<uint8_t>> payloads;
+};
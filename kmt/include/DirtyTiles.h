@@ -0,0 +1,41 @@
+// DirtyTiles.h - Change detection on a grid of tiles
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Splits the frame into square tiles and keeps, per tile, the input
+ * its cached results were computed from. A tile (and its neighbours,
+ * which a blur reaches into) is dirty when enough of its pixels moved
+ * away from that reference, so noise below the threshold never
+ * triggers work but slow drift eventually does.
+ *
+ * Inputs are the frame and optionally the background, both single
+ * channel CV_8U or CV_16U.
+ */
+class DirtyTiles {
+public:
+	DirtyTiles(Size frameSize, int tileSize, int changeThreshold, int minChanged = 4);
+
+	vector<Rect> update(Mat frame, Mat bg, Rect window);
+	void invalidate();
+	int tileSize() const;
+
+private:
+	bool changed(int tx, int ty, const Mat& frame, const Mat& bg) const;
+	Rect tileRect(int tx, int ty) const;
+
+	Size frameSize;
+	int size;
+	int changeThreshold;
+	int minChanged;
+	Size grid;				// Tiles per row and column
+	vector<bool> valid;		// Per tile, reference (and cached results) up to date
+	Mat frameRef, bgRef;	// Input the cached results were computed from
+};
@@ -0,0 +1,48 @@
+// FloorModel.h - Expected depth of the empty arena from fitted planes
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Models the empty arena in raw depth (mm) as a floor plane plus
+ * optional wall planes, so the animal is whatever is more than some
+ * height above them. No background image (and its 8-bit quantisation
+ * and blur) is involved.
+ *
+ * The depth of a plane seen by a pinhole camera satisfies
+ * 1 / z = a * u + b * v + c in pixel coordinates, so planes are fitted
+ * (RANSAC, then least squares) without the camera intrinsics. Pixels
+ * no plane explains (clutter) keep their learned depth.
+ */
+class FloorModel {
+public:
+	FloorModel();
+	FloorModel(Mat expected);
+
+	void add(Mat depth);
+	int count() const;
+	int fit(int walls, float tolerance = 15);
+
+	Mat expected() const;
+	Mat limit(float height) const;
+
+private:
+	struct Plane {
+		double a, b, c; // 1 / z = a * u + b * v + c
+
+		double depth(double u, double v) const;
+	};
+
+	static bool solvePlane(const vector<Point3f>& points, Plane& plane);
+	Plane ransac(const vector<Point3f>& samples, float tolerance, int& inliers) const;
+
+	Mat reference;		// CV_16U, deepest valid depth seen per pixel
+	Mat expectedDepth;	// CV_16U
+	int added = 0;
+};
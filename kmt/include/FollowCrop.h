@@ -0,0 +1,25 @@
+// FollowCrop.h - Fixed size window following the tracked animal
+#pragma once
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Square window of fixed size that follows a position with smoothed
+ * motion: it eases towards the position, but never lets it get closer
+ * than a margin to the edge, and stays inside the frame.
+ */
+class FollowCrop {
+public:
+	FollowCrop(Size frameSize, int size, float smoothing = 0.2f);
+
+	Rect update(Point2f position);
+	Size size() const;
+
+private:
+	Size frameSize;
+	Size windowSize;
+	float smoothing;
+	Point2f center;
+};
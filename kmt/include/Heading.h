@@ -0,0 +1,33 @@
+// Heading.h - Body orientation and head/tail direction of a blob
+#pragma once
+
+// Internal
+#include "Blob.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+void setBlobShape(Blob& blob, double mu20, double mu11, double mu02);
+
+/**
+ * Resolves the head/tail ambiguity of a blob's body axis over time:
+ * while the animal moves the end in the direction of motion is the
+ * head, while it doesn't the end closest to the last heading is.
+ *
+ * Angles are in degrees, clockwise (image coordinates) from the x axis.
+ */
+class HeadingFilter {
+public:
+	void update(const Blob& blob, Point2f velocity);
+
+	float angle() const;
+	float elongation() const;
+	float heading() const;
+
+private:
+	float axis = 0;		  // Body axis (rad), [-pi/2, pi/2)
+	float elong = 1;	  // Major / minor axis length
+	float head = 0;		  // Heading (rad), [0, 2 pi)
+	bool initialised = false;
+};
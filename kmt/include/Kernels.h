@@ -0,0 +1,16 @@
+// Kernels.h - Vectorised per pixel kernels
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+void diffThresholdMap(const Mat& frame, const Mat& bg, const Mat& thresholds, Mat& mask);
+void diffThresholdHist(const Mat& frame, const Mat& bg, int threshold, Mat& mask, unsigned int* hist);
+void closerThan(const Mat& depth, const Mat& limit, Mat& mask);
+int countChanged(const Mat& a, const Mat& b, int threshold, int limit);
+void temporalMedian(const vector<const Mat*>& frames, Mat& out);
@@ -15,6 +15,8 @@ class KinectWrapper {
 public:
 	static const int        cDepthWidth = 512;
 	static const int        cDepthHeight = 424;
+	static const int        cColorWidth = 1920;
+	static const int        cColorHeight = 1080;
 	static const int		frameUpdateTimeout = 5000;
 
 	KinectWrapper();
@@ -24,4 +24,11 @@ public:
 	NoFrameException();
 	NoFrameException(const char* msg);
 	const char * what() const;
+};
+
+class EndOfReplayException : public exception {
+public:
+	EndOfReplayException();
+	EndOfReplayException(const char* msg);
+	const char * what() const;
 };
\ No newline at end of file
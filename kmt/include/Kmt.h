@@ -1,8 +1,24 @@
 // Kmt.h - Logic for Kinect Mouse Tracker
 #pragma once
 
+// std
+#include <memory>
+#include <vector>
+using namespace std;
+
 // Internal
+#include "ArenaMask.h"
+#include "AutoThreshold.h"
+#include "BackgroundModel.h"
+#include "Blob.h"
+#include "DepthArchive.h"
+#include "DirtyTiles.h"
+#include "Heading.h"
 #include "KinectWrapper.h"
+#include "MotionModel.h"
+#include "MultiTracker.h"
+#include "Overlay.h"
+#include "ProcessingGraph.h"
 
 // OpenCV
 #include <opencv2/opencv.hpp>
@@ -17,26 +33,109 @@ using matSource = Mat(Kmt::*)();
 using matOutput = void(Kmt::*)(Mat(Kmt::*)());
 
 struct findPosOutput {
-	Mat frame;
+	Overlay overlay;
 	tWord x;
 	tWord y;
+	float angle;
+	float elongation;
+	float heading;
+};
+
+struct findPosMultiOutput {
+	Overlay overlay;
+	vector<tWord> x;
+	vector<tWord> y;
+	vector<float> angle;
+	vector<float> elongation;
+	vector<float> heading;
 };
 
 class Kmt {
 public:
 	Kmt();
+	Kmt(shared_ptr<KinectWrapper> kinect);
 	Mat blur(Mat frame, int blurSize);
-	Mat diffThreshold(Mat frame, int thresholdValue);
-	findPosOutput findPos(Mat frame, float minimumSize);
+	Mat diffThreshold(Mat frame, int thresholdValue, Rect window = Rect());
+	vector<Blob> findBlobs(Mat frame, float minimumSize, Point offset = Point(0, 0));
+	findPosOutput findPos(Mat frame, float minimumSize, Point offset = Point(0, 0));
+	findPosMultiOutput findPosMulti(Mat frame, float minimumSize, Point offset = Point(0, 0));
+	void enablePrediction(MotionModel model);
+	void enableMultiTracking(int animals, MotionModel model);
+	Rect predict(unsigned int t, Size frameSize);
 	Mat getDepthMat();
 	Mat getColorMat();
+	Mat getRawDepthMat();
+	Mat lastRawDepthMat();
+	Rect setDepthCrop(Rect crop);
+	Rect getDepthCrop() const;
+	Rect setColorCrop(Rect crop);
+	void enableHoleFilling(Mat fill = Mat());
+	void enableReplay(string fileName);
+	unsigned replayTime() const;
+	void setArenaMask(Mat mask, Mat outside = Mat());
 	void setBg(Mat bg);
+	void setBgNoise(Mat sd, float sigmas, int minThreshold = 0);
+	void setFloorLimit(Mat limit);
+	Mat segment(Mat frame, Rect& window, int blurSize, int thresholdValue);
+	void enableTiles(int tileSize, int changeThreshold);
+	void enablePyramid(int factor, float minimumSize);
+	void enableAutoThreshold(int initial);
+	void setGraph(unique_ptr<ProcessingGraph> graph);
+	int currentThreshold() const;
+	void enableAdaptiveBg(int blurSize, int thresholdValue, int learningShift);
+	void learnBg(Mat frame);
 
 private:
 	int frameUpdateTimeout = 5000;
-	KinectWrapper kinect;
-	Mat colorFrameBufToGrayscaleMat(tByte* buf);
-	Mat depthBufToGrayscaleMat(tWord* buf);
+	shared_ptr<KinectWrapper> kinect;
+	Rect depthCrop = Rect(Point(45, 40), Point(475, 250)); // 512 * 424
+	Rect colorCrop = Rect(Point(400, 240), Point(1710, 850)); // 1920 * 1080
+	Mat colorFrameBufToGrayscaleMat(tByte* buf, Rect crop);
+	Mat depthBufToGrayscaleMat(tWord* buf, Rect crop);
+	tWord* lastDepthBuf = nullptr; // Of the last captured depth frame
+	tWord* nextDepthBuf();
+	unique_ptr<DepthArchiveReader> replay; // Replaces the sensor's depth stream
+	Mat replayDepth;					   // Sensor sized, the archived frames at their origin
+	unsigned replayT = 0;				   // Capture time of the last replayed frame (ms)
+	bool fillHoles = false;
+	Mat holeFill; // Intensities invalid depth is replaced by, empty for the neighbours
+	ArenaMask arenaMask;
+	Mat outsideMask; // Inverse of the arena mask
+	Mat outsideFill; // Intensities outside the arena are taken from, empty for 0
 	Mat bg;
+	unique_ptr<BackgroundModel> bgModel;
+	Mat thresholdMap; // Per pixel threshold, empty for a global one
+	Mat floorLimit;	  // Per pixel depth limit (mm), empty without a floor model
+	Mat diffAgainst(Mat frame, Mat background, int thresholdValue, Rect window);
+	void diffSpan(Mat frame, Mat background, int thresholdValue, Rect region, Mat& mask);
+	Mat segmentWindow(Mat frame, Rect& window, int blurSize, int thresholdValue);
+	Mat segmentRegion(Mat frame, Mat background, Rect region, int blurSize, int thresholdValue);
+	unique_ptr<AutoThreshold> autoThreshold;
+	unique_ptr<ProcessingGraph> graph;
+	unique_ptr<DirtyTiles> tiles;
+	int tileSize = 0, tileChangeThreshold = 0;
+	int tileThreshold = -1;	  // Threshold the cached tiles were segmented with
+	Mat tileMask;			  // Cached mask of the whole frame
+	bool tilesChanged = true; // Any tile reprocessed by the last segment()
+	vector<Blob> cachedBlobs; // Last findBlobs() result, reused while nothing changed
+	Point cachedOffset;
+	Size cachedSize;
+	Rect coarseDetect(Mat frame, Mat background, Rect window, int blurSize, int thresholdValue);
+	int pyramidFactor = 1;
+	float pyramidMinimumSize = 0;
+	Mat coarseBg, coarseThresholdMap, coarseLimit; // Downsampled, rebuilt when their source changes
+	const uchar* coarseBgSource = nullptr;
+	bool sampleDiffs = false;	 // segment() diffs only part of the frame, the auto threshold samples it
+	Mat sampleBg, sampleOutside; // At 1 / diffSampleFactor, rebuilt when their source changes
+	const uchar* sampleBgSource = nullptr;
+	void sampleDifferences(Mat frame, Mat background, int blurSize);
+	Size frameSize;	  // Of the frame the last predict() was for
 	Point2f lastPos;
+	bool predictive = false;
+	MotionModel motion;
+	unique_ptr<MultiTracker> multi;
+	unsigned int lastT = 0;
+	float lastDt = 0;
+	HeadingFilter heading;
+	int searchMargin = 40; // Object radius + blur kernel, in px
 };
\ No newline at end of file
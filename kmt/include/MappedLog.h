@@ -0,0 +1,51 @@
+// MappedLog.h - Crash-safe memory-mapped data log
+#pragma once
+
+// std
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "TrajectoryFile.h"
+
+// win
+#include <Windows.h>
+
+/**
+ * Data log in a preallocated memory-mapped file. A row is a fixed size
+ * record of 32 bit integers (value * column scale) stored straight into
+ * the mapping, then the record count in the header is updated
+ * atomically. The pages belong to the OS, so every counted row survives
+ * the process being killed. A clean close() truncates the file to the
+ * rows written.
+ *
+ * Layout (little endian):
+ *   header: "KMTL" u16 version u16 columns u32 record size u32 data offset
+ *			 u64 rows (atomic), per column u16 scale u16 length name
+ *   records from the data offset, one i32 per column
+ */
+class MappedLog {
+public:
+	MappedLog(string fileName, vector<TrajectoryColumn> columns, uint64_t capacity = 1 << 18);
+	~MappedLog();
+
+	void write(const vector<double>& row);
+	void close();
+
+private:
+	void map(uint64_t rows);
+	void unmap();
+
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+	uint8_t* view = nullptr;
+	vector<TrajectoryColumn> columns;
+	uint32_t recordSize;
+	uint32_t dataOffset;
+	uint64_t capacity = 0;	// Rows the mapping holds
+	uint64_t rows = 0;
+};
+
+void mappedLogToCsv(string fileName, string csvFileName);
@@ -0,0 +1,36 @@
+// MedianBackground.h - Per pixel temporal median over many frames
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Streaming per pixel median of grayscale frames, for learning a
+ * background while the animal moves around: as long as it covers a
+ * pixel in less than half of the frames the median is the background.
+ *
+ * Every pixel keeps a 32 bin histogram of 16-bit counts (64 bytes, one
+ * cache line), the median is interpolated within its bin. Memory does
+ * not depend on the number of frames.
+ */
+class MedianBackground {
+public:
+	MedianBackground(Size size);
+
+	void add(Mat frame);
+	int count() const;
+	Mat median() const;
+
+private:
+	static const int binShift = 3; // 8 intensities per bin
+	static const int bins = 256 >> binShift;
+
+	Size size;
+	int added = 0;
+	vector<unsigned short> histograms; // Pixel major, bins per pixel
+};
@@ -0,0 +1,54 @@
+// MotionModel.h - Predictive (constant velocity Kalman) motion model
+#pragma once
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Constant velocity Kalman filter over the tracked position.
+ *
+ * Both axes are filtered independently (state: position, velocity)
+ * so every step is a handful of scalar operations, independent of the
+ * frame size.
+ */
+class MotionModel {
+public:
+	MotionModel(float processNoise = 100000, float measurementNoise = 4, float gateSigma = 4, int maxCoast = 15);
+
+	void reset(Point2f pos);
+	void predict(float dt);
+	bool gate(Point2f measurement) const;
+	float gateDistance(Point2f measurement) const;
+	float gateLimit() const;
+	void correct(Point2f measurement);
+	void coast();
+
+	bool isTracking() const;
+	Point2f position() const;
+	Point2f velocity() const;
+	Size2f uncertainty() const;
+	Rect searchWindow(Size frameSize, int margin) const;
+
+private:
+	struct Axis {
+		float p = 0; // Position (px)
+		float v = 0; // Velocity (px/s)
+		float p00 = 0, p01 = 0, p11 = 0; // Covariance (symmetric)
+
+		void reset(float pos, float posVar, float velVar);
+		void predict(float dt, float q);
+		void correct(float z, float r);
+		float innovationVar(float r) const;
+	};
+
+	float processNoise;
+	float measurementNoise;
+	float gateSigma;
+	int maxCoast;
+
+	Axis x, y;
+	Point2f lastCorrected; // Position kept once the track is lost
+	bool initialised = false;
+	int coasted = 0;
+};
@@ -0,0 +1,44 @@
+// MultiTracker.h - Tracks several animals with stable identities
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// Internal
+#include "Blob.h"
+#include "Heading.h"
+#include "MotionModel.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Keeps one motion model per animal and assigns every frame's
+ * detections to them with a minimum cost (Hungarian) assignment
+ * on the gated Mahalanobis distance, per cluster of overlapping gates. Blobs of animals touching each
+ * other are split around the predicted positions first.
+ */
+class MultiTracker {
+public:
+	MultiTracker(int animals, MotionModel model);
+
+	void predict(float dt);
+	void update(vector<Blob> blobs, Mat mask, Point offset);
+
+	int size() const;
+	bool isTracking(int i) const;
+	Point2f position(int i) const;
+	const HeadingFilter& heading(int i) const;
+
+private:
+	vector<Blob> splitMerged(const vector<Blob>& blobs, Mat mask, Point offset) const;
+	vector<Blob> splitBlob(const Blob& blob, const vector<int>& trackIds, Mat mask, Point offset) const;
+	static vector<int> assign(const vector<vector<float>>& cost);
+
+	vector<MotionModel> tracks;
+	vector<HeadingFilter> headings;
+	float gateCost;
+	double singleArea = 0; // Running estimate of the area of one animal (px^2)
+};
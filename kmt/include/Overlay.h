@@ -0,0 +1,44 @@
+// Overlay.h - Lazily rendered marked frame
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * What the marked frame of a tracked frame shows: the thresholded
+ * mask and the marks of the found animals. Detection only records
+ * them, the color conversion and drawing happen in render(), called
+ * by the sinks that show or encode the frame, if any.
+ */
+class Overlay {
+public:
+	Overlay();
+	Overlay(Mat mask, Size size, Point offset, bool outlineMask);
+
+	void mark(Point2f position, int radius, Scalar color, int thickness);
+	void mark(Point2f position, int radius, Scalar color, int thickness, float heading);
+	Size size() const;
+	void render(Mat& out) const;
+	Mat render() const;
+
+private:
+	struct Mark {
+		Point2f position;
+		int radius;
+		Scalar color;
+		int thickness;
+		bool hasHeading;
+		float heading; // Deg
+	};
+
+	Mat mask;			// CV_8U
+	Size canvasSize;	// Of the marked frame
+	Point offset;		// Of the mask in it
+	bool outlineMask;	// Draw the mask's bounds
+	vector<Mark> marks;
+};
@@ -0,0 +1,141 @@
+// Pipeline.h - Frame sources and the fused templated segmentation kernel
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// Internal
+#include "Kmt.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+// Frame source, picked once at startup
+enum SourceKind {
+	depthSource,	// Depth mapped to 8-bit intensities
+	colorSource,	// Grayscale of the color camera
+	rawDepthSource	// Depth in mm, 16-bit
+};
+
+/**
+ * Captures a frame from the given source, for callers that know it at
+ * compile time.
+ */
+template<SourceKind kind>
+inline Mat capture(Kmt& kmt);
+
+template<>
+inline Mat capture<depthSource>(Kmt& kmt) {
+	return kmt.getDepthMat();
+}
+
+template<>
+inline Mat capture<colorSource>(Kmt& kmt) {
+	return kmt.getColorMat();
+}
+
+template<>
+inline Mat capture<rawDepthSource>(Kmt& kmt) {
+	return kmt.getRawDepthMat();
+}
+
+/**
+ * Captures a frame from the source picked at startup. The frame loop
+ * stays dynamic: this switch is one predictable branch per frame, and
+ * its per pixel work is in Kmt::segment(), whose variants (tiles,
+ * pyramid, graph, noise map) would multiply with every source and blur
+ * size if the loop were a template. Only the fused kernel is.
+ */
+inline Mat capture(Kmt& kmt, SourceKind kind) {
+	switch (kind) {
+		case colorSource:
+			return capture<colorSource>(kmt);
+		case rawDepthSource:
+			return capture<rawDepthSource>(kmt);
+		default:
+			return capture<depthSource>(kmt);
+	}
+}
+
+// Index of a pixel mirrored at the edges without repeating them (OpenCV's BORDER_REFLECT_101)
+inline int reflect101(int i, int n) {
+	if (i < 0) return -i;
+	if (i >= n) return 2 * n - 2 - i;
+	return i;
+}
+
+/**
+ * Blurs, diffs with the background and thresholds a region in a single
+ * pass, without intermediate frames: mask = |blur(frame) - bg| > threshold ? 255 : 0
+ *
+ * The box sum slides down the rows (one add and subtract per column)
+ * and along each row. With K > 0 the kernel size is a compile-time
+ * constant, so the loops unroll and the division by K * K becomes a
+ * multiplication; K = 0 is the generic version for any odd size.
+ * Neighbours outside the region come from the frame, mirrored at its
+ * edges, so the result is that of cv::blur() on the whole frame.
+ *
+ * It is scalar: OpenCV's vectorised blur, absdiff and threshold are
+ * 4-15x faster on the tracked frame sizes (--benchmark), so
+ * segmentation uses those and this is only kept for --benchmark.
+ *
+ * args: frame: full frame
+ *		 region: region of the frame to process
+ *		 bg: background of the region, same type as the frame
+ *		 threshold
+ *		 mask: output, CV_8U, region sized
+ *		 size: kernel size iff K = 0, odd
+ */
+template<typename T, int K>
+void blurDiffThreshold(const Mat& frame, Rect region, const Mat& bg, int threshold, Mat& mask, int size = K) {
+	const int k = K > 0 ? K : size;
+	const int r = k / 2;
+	const int area = k * k;
+	const int width = region.width;
+	const int padded = width + 2 * r;
+	bool inside = region.x - r >= 0 && region.x + width + r <= frame.cols;
+
+	mask.create(region.size(), CV_8U);
+	vector<int> columns(padded, 0); // Vertical sums
+	vector<T> inBuf(padded), outBuf(padded);
+
+	// Row y of the frame, from r left to r right of the region
+	auto row = [&](int y, vector<T>& buf) -> const T* {
+		const T* src = frame.ptr<T>(reflect101(y, frame.rows));
+		if (inside) return src + region.x - r;
+		for (int j = 0; j < padded; j++)
+			buf[j] = src[reflect101(region.x - r + j, frame.cols)];
+		return buf.data();
+	};
+
+	for (int dy = -r; dy <= r; dy++) {
+		const T* in = row(region.y + dy, inBuf);
+		for (int j = 0; j < padded; j++)
+			columns[j] += in[j];
+	}
+
+	for (int y = 0; y < region.height; y++) {
+		if (y > 0) {
+			const T* out = row(region.y + y - 1 - r, outBuf);
+			const T* in = row(region.y + y + r, inBuf);
+			for (int j = 0; j < padded; j++)
+				columns[j] += in[j] - out[j];
+		}
+
+		const T* b = bg.ptr<T>(y);
+		unsigned char* m = mask.ptr<unsigned char>(y);
+		int sum = 0;
+		for (int j = 0; j < k; j++)
+			sum += columns[j];
+		for (int x = 0; x < width; x++) {
+			if (x > 0) sum += columns[x + k - 1] - columns[x - 1];
+			int diff = (sum + area / 2) / area - b[x]; // Odd area, never exactly half way
+			m[x] = (diff < 0 ? -diff : diff) > threshold ? 255 : 0;
+		}
+	}
+}
+
+bool blurDiffThreshold(const Mat& frame, Rect region, const Mat& bg, int blurSize, int threshold, Mat& mask);
+bool blurDiffThresholdGeneric(const Mat& frame, Rect region, const Mat& bg, int blurSize, int threshold, Mat& mask);
@@ -0,0 +1,48 @@
+// Preview.h - Rate limited preview window on its own thread
+#pragma once
+
+// std
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Shows the latest frame in a window from a display thread, at most
+ * maxFps times a second and optionally downscaled. Frames are handed
+ * over as a function that draws them through a triple buffer:
+ * publish() never waits, frames the display doesn't get to are never
+ * drawn, and all HighGUI calls stay on the display thread.
+ */
+class Preview {
+public:
+	Preview(string windowName, int maxFps = 15, double scale = 1);
+	~Preview();
+
+	void publish(function<void(Mat&)> render);
+	bool keyPressed() const;
+	void close();
+
+private:
+	void displayLoop();
+
+	string windowName;
+	chrono::milliseconds period;
+	double scale;
+
+	// Back is written by publish(), front is drawn by the display thread
+	function<void(Mat&)> buffers[3];
+	int back = 0;
+	int front = 2;
+	atomic<int> middle;		// Index, | freshFlag when not yet shown
+
+	atomic<bool> pressed;
+	atomic<bool> stopping;
+	thread display;
+};
@@ -0,0 +1,83 @@
+// ProcessingGraph.h - Segmentation chain configured from a file
+#pragma once
+
+// std
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Internal
+#include "TemporalFilter.h"
+#include "ThreadPool.h"
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Graph of processing stages from the converted frame to the mask the
+ * animal is detected in, read from a file so a rig can try other
+ * preprocessing without a rebuild. Every non-empty line that doesn't
+ * start with # is one stage:
+ *
+ *   name type [input[,input]] [key=value ...]
+ *
+ * Stages can only use stages defined before them. Types:
+ *
+ *   convert						the converted frame (window), no inputs
+ *   temporal	frames=3|5			temporal median, see TemporalFilter (of the
+ *									window, restarts when its size changes)
+ *   blur		size=N				box blur
+ *   bgdiff							absolute difference with the background
+ *   threshold	value=N				binary threshold
+ *   morphology	op=open|close|erode|dilate size=N
+ *   and, or						combines two masks
+ *   detect							the mask to detect in, exactly one
+ *
+ * e.g. frame convert / blurred blur frame size=15 / diff bgdiff blurred /
+ * mask threshold diff value=30 / out detect mask.
+ *
+ * The background is only blurred (with -b), so a bgdiff can only follow
+ * the frame through temporal stages and one blur of that size.
+ *
+ * Planning fuses blur, bgdiff and threshold chains (without other
+ * consumers in between) into one stage and runs the stages of each
+ * depth in the graph (independent branches) concurrently.
+ */
+class ProcessingGraph {
+public:
+	ProcessingGraph(string fileName);
+
+	Mat run(Mat frame, Rect window, Mat background);
+	string plan() const;
+	int bgBlurSize() const;
+
+private:
+	enum StageType { convertStage, temporalStage, blurStage, bgdiffStage, thresholdStage, morphologyStage, andStage, orStage, detectStage, fusedStage };
+
+	struct Stage {
+		string name;
+		StageType type;
+		vector<int> inputs;
+		map<string, int> params;
+		string op;							// Morphology operation
+		Mat kernel;							// Morphology structuring element
+		shared_ptr<TemporalFilter> filter;	// Temporal state
+		bool fused = false;					// Merged into a later stage
+		int blurSize = 1;					// Fused stage
+		int thresholdValue = 0;				// Fused stage
+	};
+
+	void fuse();
+	void schedule();
+	void runStage(int i, Mat frame, Rect window, Mat background);
+
+	vector<Stage> stages;
+	int output = -1;
+	int bgBlur = 0; // In front of bgdiff
+	vector<vector<int>> levels; // Stages that only depend on earlier levels
+	vector<Mat> results;
+	unique_ptr<ThreadPool> pool;
+};
@@ -0,0 +1,31 @@
+// TemporalFilter.h - Per pixel temporal median of the last few frames
+#pragma once
+
+// std
+#include <vector>
+using namespace std;
+
+// OpenCV
+#include <opencv2/opencv.hpp>
+using namespace cv;
+
+/**
+ * Removes depth flicker (mostly at object edges) over time instead of
+ * space, so a much smaller blur keeps the outline sharp.
+ *
+ * Keeps the last 3 or 5 frames in a preallocated ring and returns their
+ * per pixel median: a flickering pixel has to be off in most of them to
+ * show, a moving edge lags at most a frame or two. Memory and cost per
+ * pixel are constant.
+ */
+class TemporalFilter {
+public:
+	TemporalFilter(int frames);
+
+	Mat apply(Mat frame);
+
+private:
+	vector<Mat> ring;
+	int next = 0;
+	int filled = 0;
+};
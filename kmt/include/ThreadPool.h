@@ -0,0 +1,31 @@
+// ThreadPool.h - Fixed size pool of worker threads
+#pragma once
+
+// std
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+using namespace std;
+
+class ThreadPool {
+public:
+	ThreadPool(int threads = thread::hardware_concurrency());
+	~ThreadPool();
+
+	future<void> submit(function<void()> task);
+	void parallelFor(int n, const function<void(int)>& body);
+	int size() const;
+
+private:
+	void work();
+
+	vector<thread> workers;
+	queue<packaged_task<void()>> tasks;
+	mutex tasksMutex;
+	condition_variable tasksChanged;
+	bool stopping = false;
+};
@@ -0,0 +1,89 @@
+// TrajectoryFile.h - Compact binary trajectory (data) files
+#pragma once
+
+// std
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Column of a data file, values are stored as integers in 1 / scale units
+struct TrajectoryColumn {
+	string name;
+	int scale;
+};
+
+// Index entry of one block
+struct TrajectoryBlock {
+	int64_t firstT;	// First value of the first column, in its units
+	uint64_t offset;	// Of the block header in the file
+	uint32_t rows;
+};
+
+/**
+ * Writes a binary trajectory file. Rows are gathered in blocks of up to
+ * blockRows rows, every column is stored as the zigzag varint of its
+ * difference to the previous row (to 0 at the start of a block), so a
+ * slowly moving animal costs a few bytes per row. A footer indexes the
+ * blocks by time for seeking.
+ *
+ * Layout (little endian):
+ *   header: "KMTT" u16 version u16 columns, per column u16 scale u16 length name
+ *   block:  u32 rows u32 bytes, payload
+ *   footer: per block i64 firstT u64 offset u32 rows, then u32 blocks u64 footer offset "KMTI"
+ *
+ * Every completed block is on disk, a file without footer (crash) is
+ * still read up to its last complete block.
+ */
+class TrajectoryWriter {
+public:
+	TrajectoryWriter(string fileName, vector<TrajectoryColumn> columns, int blockRows = 4096);
+	~TrajectoryWriter();
+
+	void write(const vector<double>& row);
+	void close();
+
+private:
+	void flushBlock();
+
+	ofstream out;
+	vector<TrajectoryColumn> columns;
+	int blockRows;
+	vector<uint8_t> block;	// Payload of the current block
+	uint32_t rows = 0;		// In the current block
+	vector<int64_t> previous;
+	vector<TrajectoryBlock> index;
+};
+
+/**
+ * Reads a binary trajectory file row by row, see TrajectoryWriter.
+ */
+class TrajectoryReader {
+public:
+	TrajectoryReader(string fileName);
+
+	const vector<TrajectoryColumn>& columns() const;
+	uint64_t rows() const;
+	bool next(vector<double>& row);
+	void seek(double t);
+
+private:
+	bool loadBlock(size_t i);
+	void scanBlocks();
+
+	ifstream in;
+	vector<TrajectoryColumn> cols;
+	vector<TrajectoryBlock> index;
+	size_t current = 0;		// Block being read
+	vector<uint8_t> block;
+	size_t position = 0;	// In the block
+	uint32_t remaining = 0; // Rows left in the block
+	vector<int64_t> previous;
+	vector<double> pending;	// Row found by seek(), returned by the next next()
+	bool hasPending = false;
+};
+
+void writeCsvHeader(ostream& out, const vector<TrajectoryColumn>& columns);
+void writeCsvRow(ostream& out, const vector<TrajectoryColumn>& columns, const vector<double>& row);
+void trajectoryToCsv(string fileName, string csvFileName);
@@ -20,12 +20,31 @@
 #include <vector>
 #include <sys/stat.h>
 #include <thread>
+#include <functional>
+#include <algorithm>
+#include <iomanip>
+#include <atomic>
 using namespace std;
 
 // Internal
+#include "Arena.h"
+#include "ArenaMask.h"
+#include "AsyncVideoWriter.h"
+#include "BackgroundStats.h"
+#include "DepthArchive.h"
+#include "CsvWriter.h"
+#include "FloorModel.h"
+#include "FollowCrop.h"
 #include "KinectWrapper.h"
 #include "KinectWrapperExceptions.h"
 #include "Kmt.h"
+#include "MappedLog.h"
+#include "MedianBackground.h"
+#include "Pipeline.h"
+#include "Preview.h"
+#include "TemporalFilter.h"
+#include "TrajectoryFile.h"
+#include "ThreadPool.h"
 #include "Util.h"
 
 // win
@@ -47,14 +66,42 @@ using Time = chrono::steady_clock;
 using ms = chrono::milliseconds;
 using byte = unsigned char;
 
+// Parsed command line arguments
+struct kmtArgs {
+	bool colorMode, rawMode, triggerMode, overwrite, streamOutput, videoOutput, predictMode, orientationOutput, fillHoles, autoThreshold, detectArena;
+	int blurSize, thresholdValue, fps, animals, learningShift, medianFrames, walls, tileSize, pyramidFactor, denoiseFrames, benchmarkFrames, flushInterval, videoQueue, followSize, previewFps, archiveCheckFrames;
+	float minimumSize, gateSigma, sigmas, floorHeight, previewScale;
+	string dataFileName;
+	string videoFileName;
+	string followFileName;
+	string arenaFileName;
+	string graphFileName;
+	string convertFileName;
+	string archiveFileName;
+	string replayFileName;
+	Rect crop; // Empty for the default
+	QueuePolicy videoPolicy;
+};
+
+struct dataOutput;
+
 void signalHandler(int signum);
-void kmt(bool colorMode, bool rawMode, int blurSize, int threshold, float minimumSize, bool triggerMode, bool overwrite, bool streamOutput, bool videoOutput, string dataFileName, string videoFileName, int fps);
+void kmt(kmtArgs args);
+void closeDataFile(dataOutput& dataOut);
+bool hasExtension(string fileName, string extension);
 
 // Global verbose logger
 VerboseLog verbose;
 
 // Videowriter ptr, to gracefully close on exit
-unique_ptr<VideoWriter> pVideo;
+unique_ptr<AsyncVideoWriter> pVideo;
+
+// Open data files, to write their buffered rows (and index) on exit
+vector<dataOutput*> dataOutputs;
+
+// Set while the stream loop runs, SIGINT then only asks it to stop
+atomic<bool> streaming(false);
+atomic<bool> stopRequested(false);
 
 
 int main(int argc, char** argv) {
@@ -71,20 +118,46 @@ int main(int argc, char** argv) {
 		("s,threshold", "Threshold value", cxxopts::value<int>()->default_value("30"))
 		("m,minimum", "Minimum object size", cxxopts::value<float>()->default_value("6"))
 		("t,trigger", "Wait for trigger before starting capture")
-		("o,output", "Output mode(s): (S)tream (and\\or) (V)ideo", cxxopts::value<string>())
+		("o,output", "Output mode(s): (S)tream (and\\or) (V)ideo, without S kmt runs headless (stop with enter or Ctrl-C)", cxxopts::value<string>())
+		("preview", "Stream window frames per second at most", cxxopts::value<int>()->default_value("15"))
+		("previewscale", "Stream window size relative to the frame", cxxopts::value<float>()->default_value("1"))
 		("w,overwrite", "Overwrite files on conflict")
-		("d,datafile", "Data file's name or path", cxxopts::value<string>()->default_value("data.csv"))
+		("d,datafile", "Data file's name or path, binary (compact, seekable) when it ends in .trj, memory mapped log (every row survives a crash) when it ends in .tlog", cxxopts::value<string>()->default_value("data.csv"))
+		("flush", "Write buffered CSV data rows to disk every N ms", cxxopts::value<int>()->default_value("1000"))
 		("i,videofile", "Video file's name or path", cxxopts::value<string>()->default_value("video.avi"))
-		("f,fps", "Video framerate (not stabalised, could time shift)", cxxopts::value<int>()->default_value("15"));
+		("f,fps", "Video framerate, frames are repeated or skipped to follow their capture time (index of video frame to data row and time in <video>_index.csv)", cxxopts::value<int>()->default_value("15"))
+		("archive", "Archive the raw depth frames losslessly (compressed, 16 bit mm) to the given file for later analysis (depth only)", cxxopts::value<string>())
+		("replay", "Track the frames of a raw depth archive (see --archive) instead of the sensor, as fast as they are processed, with their capture times", cxxopts::value<string>())
+		("checkarchive", "Archive N raw depth frames to a temporary file, read them back and compare, report the compression and decoding speed and exit", cxxopts::value<int>()->default_value("0"))
+		("follow", "Also write a N*N px video centred on the animal (full resolution, unmarked) for close up or pose analysis, 0 to disable (one animal, not with -a or -z)", cxxopts::value<int>()->default_value("0"))
+		("followfile", "Animal centred video's name or path", cxxopts::value<string>()->default_value("follow.avi"))
+		("videoqueue", "Frames waiting for the video encoder thread at most", cxxopts::value<int>()->default_value("8"))
+		("videopolicy", "When the video queue is full: block (wait), drop (skip the frame) or spill (to a file next to the video, encoded later)", cxxopts::value<string>()->default_value("block"))
+		("p,predict", "Predictive tracking, gate and smooth positions with a motion model and only process around the prediction")
+		("g,gate", "Prediction gate, in standard deviations", cxxopts::value<float>()->default_value("4"))
+		("n,animals", "Number of animals to track, columns x1,y1...xn,yn", cxxopts::value<int>()->default_value("1"))
+		("k,median", "Capture the background as the per pixel median of N frames, the animal may be present, 0 for a single frame", cxxopts::value<int>()->default_value("0"))
+		("x,sigma", "Per pixel threshold of N standard deviations of the background noise (learned once, bg_sd.png), never below -s, 0 to disable", cxxopts::value<float>()->default_value("0"))
+		("l,learn", "Adaptive background, learn where no animal is at a rate of 1/2^N per update (every 5th frame), 0 to disable", cxxopts::value<int>()->default_value("0"))
+		("e,orientation", "Output body axis, elongation and heading, columns angle,elongation,heading")
+		("a,arenas", "Arena config file, tracks each arena in it in parallel with its own background, threshold and data file", cxxopts::value<string>())
+		("z,floor", "Floor model instead of a background (depth only), the animal is anything N mm above the fitted floor and walls (learned once, floor.png), 0 to disable", cxxopts::value<float>()->default_value("0"))
+		("walls", "Maximum number of wall planes fitted after the floor", cxxopts::value<int>()->default_value("4"))
+		("tiles", "Only reprocess N*N px tiles that changed since the last frame, 0 to disable", cxxopts::value<int>()->default_value("0"))
+		("pyramid", "Detect on a N times (2 or 4) downsampled frame first and only segment around the detection at full resolution, 1 to disable", cxxopts::value<int>()->default_value("1"))
+		("denoise", "Temporal median over the last N (3 or 5) frames before processing, allows a much smaller blur, 0 to disable", cxxopts::value<int>()->default_value("0"))
+		("fill", "Fill pixels without depth from the background (from their neighbours while capturing it) instead of treating them as 0")
+		("auto", "Select the threshold automatically from the difference histogram while tracking, starting at -s")
+		("crop", "Region of the sensor frame to process, x,y,width,height or a file containing x y width height (not with -a)", cxxopts::value<string>())
+		("detect", "Detect the arena (floor) in the background once (bg_mask.png) and only process the pixels inside it")
+		("graph", "Processing graph file describing the chain from the converted frame to the detection mask, replaces -s, its blur before bgdiff has to match -b", cxxopts::value<string>())
+		("benchmark", "Time the segmentation stages (separate, fused generic, fused specialised for -b) on N frames and exit", cxxopts::value<int>()->default_value("0"))
+		("convert", "Convert a binary (.trj) or log (.tlog) data file to CSV (same name, .csv) and exit", cxxopts::value<string>());
 
 	string helpStr = argParser.help({ "", "Group" });
 
 	// Args to parse
-	bool colorMode, rawMode, triggerMode, overwrite, streamOutput, videoOutput;
-	int blurSize, thresholdValue, fps;
-	float minimumSize;
-	string dataFileName;
-	string videoFileName;
+	kmtArgs kArgs;
 
 	try {
 		cxxopts::ParseResult args = argParser.parse(argc, argv);
@@ -95,31 +168,107 @@ int main(int argc, char** argv) {
 			return 0;
 		}
 		verbose.enabled = args.count("verbose"); // Verbose mode
-		colorMode = args.count("color"); // Color mode
-		rawMode = args.count("raw"); // Raw mode
-		blurSize = args["blur"].as<int>(); // Blur size
-		thresholdValue = args["threshold"].as<int>(); // Threshold value
-		minimumSize = args["minimum"].as<float>(); // Minimum size
-		triggerMode = args.count("trigger"); // Trigger mode
-		overwrite = args.count("overwrite"); // Overwrite mode
-
-		streamOutput = videoOutput = false; // Output mode(s)
+		kArgs.colorMode = args.count("color"); // Color mode
+		kArgs.rawMode = args.count("raw"); // Raw mode
+		kArgs.blurSize = args["blur"].as<int>(); // Blur size
+		kArgs.thresholdValue = args["threshold"].as<int>(); // Threshold value
+		kArgs.minimumSize = args["minimum"].as<float>(); // Minimum size
+		kArgs.triggerMode = args.count("trigger"); // Trigger mode
+		kArgs.overwrite = args.count("overwrite"); // Overwrite mode
+
+		kArgs.streamOutput = kArgs.videoOutput = false; // Output mode(s)
 		if (args.count("output")) {
 			string outputModesStr = args["output"].as<string>();
 			const char* outputModes = outputModesStr.c_str();
 			for (byte i = 0; i < outputModesStr.length(); i++) {
 				switch (tolower(outputModes[i])) {
 					case 's':
-						streamOutput = true; break;
+						kArgs.streamOutput = true; break;
 					case 'v':
-						videoOutput = true; break;
+						kArgs.videoOutput = true; break;
 				}
 			}
 		}
 		
-		dataFileName = args["datafile"].as<string>(); // Data filename
-		videoFileName = args["videofile"].as<string>(); // Video filename
-		fps = args["fps"].as<int>(); // Fps
+		kArgs.previewFps = args["preview"].as<int>(); // Stream window rate
+		kArgs.previewScale = args["previewscale"].as<float>(); // Stream window scale
+		if (kArgs.previewFps < 1 || kArgs.previewScale <= 0)
+			throw invalid_argument("Stream window rate and scale must be positive");
+		kArgs.dataFileName = args["datafile"].as<string>(); // Data filename
+		kArgs.flushInterval = args["flush"].as<int>(); // Data flush interval
+		if (kArgs.flushInterval < 1)
+			throw invalid_argument("Flush interval must be at least 1 ms");
+		kArgs.videoFileName = args["videofile"].as<string>(); // Video filename
+		kArgs.fps = args["fps"].as<int>(); // Fps
+		if (args.count("archive"))
+			kArgs.archiveFileName = args["archive"].as<string>(); // Raw depth archive
+		if (!kArgs.archiveFileName.empty() && kArgs.colorMode)
+			throw invalid_argument("The raw depth archive needs the depth stream");
+		if (args.count("replay"))
+			kArgs.replayFileName = args["replay"].as<string>(); // Raw depth archive to track
+		if (!kArgs.replayFileName.empty() && (kArgs.colorMode || !kArgs.archiveFileName.empty()))
+			throw invalid_argument("Replay reads a raw depth archive, it can't be combined with -c or --archive");
+		kArgs.archiveCheckFrames = args["checkarchive"].as<int>(); // Archive round trip
+		if (kArgs.archiveCheckFrames < 0 || (kArgs.archiveCheckFrames > 0 && kArgs.colorMode))
+			throw invalid_argument("The archive check needs a positive number of depth frames");
+		kArgs.videoQueue = args["videoqueue"].as<int>(); // Video queue size
+		if (kArgs.videoQueue < 1)
+			throw invalid_argument("Video queue must hold at least 1 frame");
+		kArgs.videoPolicy = parseQueuePolicy(args["videopolicy"].as<string>()); // Full video queue policy
+		kArgs.predictMode = args.count("predict"); // Predict mode
+		kArgs.gateSigma = args["gate"].as<float>(); // Prediction gate
+		kArgs.animals = args["animals"].as<int>(); // Number of animals
+		if (kArgs.animals < 1)
+			throw invalid_argument("Number of animals must be at least 1");
+		kArgs.orientationOutput = args.count("orientation"); // Orientation output
+		kArgs.medianFrames = args["median"].as<int>(); // Median background frames
+		kArgs.sigmas = args["sigma"].as<float>(); // Per pixel threshold
+		kArgs.learningShift = args["learn"].as<int>(); // Adaptive background learning rate
+		if (kArgs.learningShift < 0 || kArgs.learningShift > 8)
+			throw invalid_argument("Background learning rate must be between 0 and 8");
+		if (args.count("arenas"))
+			kArgs.arenaFileName = args["arenas"].as<string>(); // Arena config file
+		kArgs.floorHeight = args["floor"].as<float>(); // Floor model height
+		kArgs.walls = args["walls"].as<int>(); // Floor model walls
+		if (kArgs.floorHeight < 0 || kArgs.walls < 0)
+			throw invalid_argument("Floor height and number of walls can't be negative");
+		if (kArgs.floorHeight > 0 && kArgs.colorMode)
+			throw invalid_argument("The floor model needs the depth stream");
+		kArgs.followSize = args["follow"].as<int>(); // Animal centred video
+		kArgs.followFileName = args["followfile"].as<string>();
+		if (kArgs.followSize < 0 || (kArgs.followSize > 0 && (kArgs.animals > 1 || kArgs.rawMode || args.count("arenas"))))
+			throw invalid_argument("The animal centred video needs one animal tracked without arenas");
+		if (kArgs.followSize > 0 && kArgs.floorHeight > 0)
+			throw invalid_argument("The animal centred video needs 8-bit frames, it can't be combined with -z");
+		kArgs.tileSize = args["tiles"].as<int>(); // Dirty tile size
+		if (kArgs.tileSize != 0 && kArgs.tileSize < kArgs.blurSize / 2 + 1)
+			throw invalid_argument("Tiles must be larger than half the blur size");
+		kArgs.pyramidFactor = args["pyramid"].as<int>(); // Coarse to fine factor
+		if (kArgs.pyramidFactor != 1 && kArgs.pyramidFactor != 2 && kArgs.pyramidFactor != 4)
+			throw invalid_argument("Pyramid factor must be 1, 2 or 4");
+		if (kArgs.pyramidFactor > 1 && kArgs.tileSize > 0)
+			throw invalid_argument("Tiles and pyramid can't be combined");
+		kArgs.denoiseFrames = args["denoise"].as<int>(); // Temporal filter
+		if (kArgs.denoiseFrames != 0 && kArgs.denoiseFrames != 3 && kArgs.denoiseFrames != 5)
+			throw invalid_argument("Temporal filter window must be 0, 3 or 5 frames");
+		kArgs.fillHoles = args.count("fill") && !kArgs.colorMode; // Hole filling, the floor model ignores holes already
+		kArgs.autoThreshold = args.count("auto"); // Automatic threshold
+		if (args.count("crop"))
+			kArgs.crop = parseCrop(args["crop"].as<string>()); // Crop
+		kArgs.detectArena = args.count("detect"); // Arena mask
+		if (args.count("graph"))
+			kArgs.graphFileName = args["graph"].as<string>(); // Processing graph
+		if (!kArgs.graphFileName.empty() && (kArgs.floorHeight > 0 || kArgs.tileSize > 0 || kArgs.pyramidFactor > 1 || kArgs.autoThreshold || kArgs.sigmas > 0))
+			throw invalid_argument("A processing graph can't be combined with -z, -x, --tiles, --pyramid or --auto");
+		kArgs.benchmarkFrames = args["benchmark"].as<int>(); // Benchmark
+		if (args.count("convert"))
+			kArgs.convertFileName = args["convert"].as<string>(); // Binary data file conversion
+		if (kArgs.benchmarkFrames > 0 && (kArgs.rawMode || kArgs.floorHeight > 0 || args.count("arenas") || kArgs.blurSize % 2 == 0))
+			throw invalid_argument("Benchmark needs a single arena background and an odd blur size");
+		if (kArgs.detectArena && kArgs.floorHeight > 0)
+			throw invalid_argument("Arena detection needs a background, it can't be combined with -z");
+		if (kArgs.autoThreshold && (kArgs.sigmas > 0 || kArgs.floorHeight > 0))
+			throw invalid_argument("Automatic threshold replaces -s, it can't be combined with -x or -z");
 
 	} catch (exception& err) {
 		cerr << "Exception parsing arguments: " << endl;
@@ -135,7 +284,18 @@ int main(int argc, char** argv) {
 
 	// Run kmt, quit on error
 	try {
-		kmt(colorMode, rawMode, blurSize, thresholdValue, minimumSize, triggerMode, overwrite, streamOutput, videoOutput, dataFileName, videoFileName, fps);
+		if (!kArgs.convertFileName.empty()) {
+			string csvFileName = kArgs.convertFileName.substr(0, kArgs.convertFileName.rfind('.')) + ".csv";
+			if (!kArgs.overwrite && fileExists(csvFileName))
+				throw runtime_error("\"" + csvFileName + "\" already exists, use -w to overwrite it");
+			if (hasExtension(kArgs.convertFileName, ".tlog"))
+				mappedLogToCsv(kArgs.convertFileName, csvFileName);
+			else
+				trajectoryToCsv(kArgs.convertFileName, csvFileName);
+			cout << "Converted to \"" << csvFileName << "\"" << endl;
+			return 0;
+		}
+		kmt(kArgs);
 	} catch (exception& err) {
 		cerr << "Unrecoverable exception occured:" << endl;
 		cerr << err.what() << endl << endl;
@@ -150,74 +310,677 @@ int main(int argc, char** argv) {
 	return 0;
 }
 
+// Data file, CSV or binary (.trj)
+struct dataOutput {
+	vector<TrajectoryColumn> columns;
+	unique_ptr<CsvWriter> csv;
+	unique_ptr<TrajectoryWriter> binary;
+	unique_ptr<MappedLog> log;
+	vector<double> row; // Being filled by track()
+};
+
+/**
+ * returns: true iff the file name ends in the extension (with dot)
+ */
+bool hasExtension(string fileName, string extension) {
+	size_t dot = fileName.rfind('.');
+	return dot != string::npos && fileName.substr(dot) == extension;
+}
+
+/**
+ * returns: columns of the data file, x and y in whole px, the
+ *			orientation with one decimal
+ */
+vector<TrajectoryColumn> dataColumns(const kmtArgs& args) {
+	vector<TrajectoryColumn> columns = { { "t (ms)", 1 } };
+	for (int i = 1; i <= args.animals; i++) {
+		string n = args.animals > 1 ? to_string(i) : "";
+		columns.push_back({ "x" + n + " (px)", 1 });
+		columns.push_back({ "y" + n + " (px)", 1 });
+		if (args.orientationOutput) {
+			columns.push_back({ "angle" + n + " (deg)", 10 });
+			columns.push_back({ "elongation" + n, 10 });
+			columns.push_back({ "heading" + n + " (deg)", 10 });
+		}
+	}
+	return columns;
+}
+
+/**
+ * Checks, creates and writes the header of a data file.
+ *
+ * args: dataOut: output to open
+ *		 fileName: binary iff it ends in .trj, mapped log iff it ends in .tlog
+ *		 args: overwrite, number of animals, orientation output and flush interval
+ */
+void initDataFile(dataOutput& dataOut, string fileName, const kmtArgs& args) {
+	if (!args.overwrite && fileExists(fileName)) {
+		cerr << "Data file \"" << fileName << "\" already exists, choose another name using the -d option" << endl;
+		exit(1);
+	}
+	dataOut.columns = dataColumns(args);
+	dataOut.row.reserve(dataOut.columns.size());
+
+	if (hasExtension(fileName, ".trj"))
+		dataOut.binary.reset(new TrajectoryWriter(fileName, dataOut.columns));
+	else if (hasExtension(fileName, ".tlog"))
+		dataOut.log.reset(new MappedLog(fileName, dataOut.columns));
+	else
+		dataOut.csv.reset(new CsvWriter(fileName, dataOut.columns, args.flushInterval));
+	dataOutputs.push_back(&dataOut);
+}
+
+/**
+ * Writes what is still buffered and closes the data file.
+ */
+void closeDataFile(dataOutput& dataOut) {
+	if (dataOut.binary) dataOut.binary->close();
+	if (dataOut.csv) dataOut.csv->close();
+	if (dataOut.log) dataOut.log->close();
+}
+
+/**
+ * Writes the row gathered in dataOut.row, it is kept until the next
+ * frame.
+ */
+void writeDataRow(dataOutput& dataOut) {
+	if (dataOut.binary)
+		dataOut.binary->write(dataOut.row);
+	else if (dataOut.log)
+		dataOut.log->write(dataOut.row);
+	else
+		dataOut.csv->write(dataOut.row);
+}
+
+/**
+ * Loads a background, or captures (once, shared by all callers) and
+ * saves it if the file doesn't exist.
+ *
+ * args: fileName
+ *		 capture: returns the blurred frame to take the background from
+ *		 flags: imread flags
+ * returns: background
+ */
+Mat loadBg(string fileName, function<Mat()> capture, int flags = IMREAD_GRAYSCALE) {
+	Mat bg = imread(fileName, flags);
+	if (bg.data == nullptr) {
+		bg = capture();
+		imwrite(fileName, bg);
+		cout << fileName << " saved" << endl;
+	}
+	return bg;
+}
+
+/**
+ * Learns a background as the per pixel median of many frames, the
+ * animal can be in the arena as long as it keeps moving.
+ *
+ * args: kmt
+ *		 source: frame source
+ *		 frames: number of frames
+ * returns: median frame (unblurred)
+ */
+Mat learnMedianBg(Kmt& kmt, SourceKind source, int frames) {
+	unique_ptr<MedianBackground> median;
+	chrono::time_point<Time> tStart = Time::now();
+
+	while (median == nullptr || median->count() < frames) {
+		Mat frame;
+		try {
+			frame = capture(kmt, source);
+		} catch (NoFrameException) {
+			continue;
+		}
+
+		if (median == nullptr)
+			median.reset(new MedianBackground(frame.size()));
+		median->add(frame);
+		cout << "Learning background: " << median->count() << "/" << frames << "      " << '\r' << flush;
+	}
+
+	cout << endl;
+	verbose("Learned background from " + to_string(frames) + " frames in " + to_string(toMs(Time::now() - tStart)) + " ms");
+	return median->median();
+}
+
+/**
+ * Captures a background filtered exactly like the tracked frames with
+ * --denoise: the temporal median of the next few frames.
+ *
+ * args: kmt
+ *		 source: frame source
+ *		 frames: window length, 3 or 5
+ * returns: filtered frame (unblurred)
+ */
+Mat learnDenoisedBg(Kmt& kmt, SourceKind source, int frames) {
+	TemporalFilter filter(frames);
+	Mat filtered;
+	for (int n = 0; n < frames;) {
+		try {
+			filtered = filter.apply(capture(kmt, source));
+			n++;
+		} catch (NoFrameException) {
+			continue;
+		}
+	}
+	return filtered;
+}
+
+/**
+ * Learns the per pixel background mean and noise from many blurred
+ * frames, the animal can be in the arena.
+ *
+ * args: kmt
+ *		 source: frame source
+ *		 frames: number of frames
+ *		 args: blur size and threshold
+ * returns: statistics
+ */
+unique_ptr<BackgroundStats> learnBgStats(Kmt& kmt, SourceKind source, int frames, const kmtArgs& args) {
+	unique_ptr<BackgroundStats> stats;
+
+	while (stats == nullptr || stats->count() < frames) {
+		Mat frame;
+		try {
+			frame = kmt.blur(capture(kmt, source), args.blurSize);
+		} catch (NoFrameException) {
+			continue;
+		}
+
+		if (stats == nullptr)
+			stats.reset(new BackgroundStats(frame.size(), args.thresholdValue));
+		stats->add(frame);
+		cout << "Learning background noise: " << stats->count() << "/" << frames << "      " << '\r' << flush;
+	}
+
+	cout << endl;
+	return stats;
+}
+
+/**
+ * Fits the floor model to many raw depth frames, the animal can be in
+ * the arena as long as it keeps moving.
+ *
+ * args: kmt
+ *		 frames: number of frames
+ *		 walls: maximum number of wall planes
+ * returns: expected depth of the empty arena (CV_16U, mm)
+ */
+Mat learnFloor(Kmt& kmt, int frames, int walls) {
+	FloorModel floor;
+	while (floor.count() < frames) {
+		try {
+			floor.add(kmt.getRawDepthMat());
+		} catch (NoFrameException) {
+			continue;
+		}
+		cout << "Learning floor: " << floor.count() << "/" << frames << "      " << '\r' << flush;
+	}
+
+	cout << endl;
+	int planes = floor.fit(walls);
+	verbose("Fitted floor model with " + to_string(planes) + " planes");
+	return floor.expected();
+}
+
+/**
+ * Times the segmentation of the same frames by the separate OpenCV
+ * stages (blur, absdiff, threshold), the fused single pass with the
+ * kernel size known at run time and the one specialised for it.
+ *
+ * args: kmt
+ *		 source: frame source
+ *		 bg: background
+ *		 args: blur size, threshold and number of frames
+ */
+void benchmarkPipeline(Kmt& kmt, SourceKind source, Mat bg, const kmtArgs& args) {
+	vector<Mat> frames;
+	while (frames.size() < args.benchmarkFrames) {
+		try {
+			frames.push_back(capture(kmt, source));
+		} catch (NoFrameException) {
+			continue;
+		}
+	}
+	Rect region(Point(0, 0), bg.size());
+
+	auto time = [&](string name, function<Mat(Mat)> segment) {
+		chrono::time_point<Time> tStart = Time::now();
+		for (Mat& frame : frames)
+			segment(frame);
+		double frameTime = chrono::duration<double, milli>(Time::now() - tStart).count() / frames.size();
+		cout << setw(12) << left << name << fixed << setprecision(3) << frameTime << " ms/frame" << endl;
+		return frameTime;
+	};
+
+	double separate = time("separate", [&](Mat frame) {
+		Mat blurred, diff, mask;
+		cv::blur(frame, blurred, Size(args.blurSize, args.blurSize));
+		absdiff(blurred, bg, diff);
+		threshold(diff, mask, args.thresholdValue, 256, 0);
+		return mask;
+	});
+	double generic = time("generic", [&](Mat frame) {
+		Mat mask;
+		blurDiffThresholdGeneric(frame, region, bg, args.blurSize, args.thresholdValue, mask);
+		return mask;
+	});
+	double specialised = time("specialised", [&](Mat frame) {
+		Mat mask;
+		blurDiffThreshold(frame, region, bg, args.blurSize, args.thresholdValue, mask);
+		return mask;
+	});
+
+	// The fused pass has to agree with the separate stages
+	int mismatches = 0;
+	for (Mat& frame : frames) {
+		Mat blurred, diff, expected, mask;
+		cv::blur(frame, blurred, Size(args.blurSize, args.blurSize));
+		absdiff(blurred, bg, diff);
+		threshold(diff, expected, args.thresholdValue, 256, 0);
+		blurDiffThreshold(frame, region, bg, args.blurSize, args.thresholdValue, mask);
+		absdiff(expected, mask, diff);
+		mismatches += countNonZero(diff);
+	}
+
+	cout << "Specialised vs separate: " << setprecision(2) << separate / specialised << "x, vs generic: " << generic / specialised << "x" << endl;
+	cout << "Mismatching pixels: " << mismatches << endl;
+}
+
+/**
+ * Round trip of the depth archive on live (or replayed) frames: writes
+ * them to a temporary archive, reads it back and compares every frame
+ * and capture time, and reports the compression and decoding speed.
+ *
+ * args: kmt
+ *		 frames: number of frames
+ * throws: runtime_error iff a frame doesn't come back the same
+ */
+void checkArchive(Kmt& kmt, int frames) {
+	string fileName = "./archive_check.kda";
+	vector<Mat> depth;
+	vector<unsigned> times;
+	chrono::time_point<Time> tStart = Time::now();
+	while (depth.size() < frames) {
+		try {
+			kmt.getRawDepthMat();
+		} catch (NoFrameException) {
+			continue;
+		}
+		depth.push_back(kmt.lastRawDepthMat().clone());
+		times.push_back(toMs(Time::now() - tStart));
+	}
+
+	chrono::time_point<Time> tWrite = Time::now();
+	DepthArchiveWriter writer(fileName, kmt.getDepthCrop());
+	for (int i = 0; i < frames; i++)
+		writer.write(depth[i], times[i]);
+	writer.close();
+	double writeMs = chrono::duration<double, milli>(Time::now() - tWrite).count();
+
+	int read = 0, mismatches = 0;
+	chrono::time_point<Time> tRead = Time::now();
+	{
+		DepthArchiveReader reader(fileName);
+		Mat frame, diff;
+		unsigned t;
+		while (reader.read(frame, t)) {
+			if (read < frames) {
+				absdiff(frame, depth[read], diff);
+				mismatches += countNonZero(diff) + (t != times[read]);
+			}
+			read++;
+		}
+	}
+	double readMs = chrono::duration<double, milli>(Time::now() - tRead).count();
+	remove(fileName.c_str());
+
+	double raw = (double)frames * depth[0].total() * 2;
+	cout << "Archive: " << fixed << setprecision(2) << raw / writer.bytesWritten() << "x smaller, " << setprecision(1) << writer.bytesWritten() * 30.0 / frames / 1e6 << " MB/s at 30 fps" << endl;
+	cout << "Compressing " << setprecision(3) << writeMs / frames << " ms/frame, decoding " << readMs / frames << " ms/frame" << endl;
+	if (read != frames || mismatches > 0)
+		throw runtime_error("Depth archive round trip failed: " + to_string(read) + "/" + to_string(frames) + " frames read, " + to_string(mismatches) + " mismatches");
+	cout << "Round trip: all " << frames << " frames identical" << endl;
+}
+
+/**
+ * returns: file name of the noise (sd) belonging to a background file
+ */
+string bgSdFileName(string bgFileName) {
+	return bgFileName.substr(0, bgFileName.rfind('.')) + "_sd.png";
+}
+
+/**
+ * returns: file name of the arena mask belonging to a background file
+ */
+string bgMaskFileName(string bgFileName) {
+	return bgFileName.substr(0, bgFileName.rfind('.')) + "_mask.png";
+}
+
+/**
+ * Loads the arena mask of a background, or detects and saves it.
+ *
+ * throws: runtime_error iff the mask doesn't match the background
+ */
+Mat loadArenaMask(string bgFileName, Mat bg) {
+	Mat mask = loadBg(bgMaskFileName(bgFileName), [&]() { return ArenaMask::detect(bg); });
+	if (mask.size() != bg.size())
+		throw runtime_error("Arena mask \"" + bgMaskFileName(bgFileName) + "\" doesn't match the background, delete it to detect the arena again");
+	return mask;
+}
+
+/**
+ * Tracks the animal(s) in one frame and writes the data row.
+ *
+ * args: kmt: tracker, background set
+ *		 frame
+ *		 t: time of capture (ms)
+ *		 thresholdValue
+ *		 args: blur size, minimum size and number of animals
+ *		 dataOut
+ * returns: marks, rendered only by the outputs that show them
+ */
+Overlay track(Kmt& kmt, Mat frame, unsigned int t, int thresholdValue, const kmtArgs& args, dataOutput& dataOut) {
+	kmt.learnBg(frame);
+
+	Rect window = kmt.predict(t, frame.size());
+	Mat processed = kmt.segment(frame, window, args.blurSize, thresholdValue);
+
+	vector<double>& row = dataOut.row;
+	row.clear();
+	row.push_back(t);
+	if (args.animals > 1) {
+		findPosMultiOutput posOutput = kmt.findPosMulti(processed, args.minimumSize, window.tl());
+		for (int i = 0; i < args.animals; i++) {
+			row.insert(row.end(), { (double)posOutput.x[i], (double)posOutput.y[i] });
+			if (args.orientationOutput)
+				row.insert(row.end(), { posOutput.angle[i], posOutput.elongation[i], posOutput.heading[i] });
+		}
+		writeDataRow(dataOut);
+		return posOutput.overlay;
+	}
+
+	findPosOutput posOutput = kmt.findPos(processed, args.minimumSize, window.tl());
+	row.insert(row.end(), { (double)posOutput.x, (double)posOutput.y });
+	if (args.orientationOutput)
+		row.insert(row.end(), { posOutput.angle, posOutput.elongation, posOutput.heading });
+	writeDataRow(dataOut);
+	return posOutput.overlay;
+}
+
+/**
+ * Enables the motion model(s) the arguments ask for.
+ */
+void initTracking(Kmt& kmt, const kmtArgs& args) {
+	if (args.animals > 1) {
+		kmt.enableMultiTracking(args.animals, MotionModel(100000, 4, args.gateSigma));
+	} else if (args.predictMode) {
+		kmt.enablePrediction(MotionModel(100000, 4, args.gateSigma));
+	}
+
+	// A tile changed when it moved half way to being detected
+	if (args.tileSize > 0) {
+		float detectable = args.floorHeight > 0 ? args.floorHeight : (float)args.thresholdValue;
+		kmt.enableTiles(args.tileSize, (std::max)(1, (int)(detectable / 2)));
+	}
+	if (args.pyramidFactor > 1)
+		kmt.enablePyramid(args.pyramidFactor, args.minimumSize);
+
+	// Own instance per tracker, stages can keep state
+	if (!args.graphFileName.empty()) {
+		unique_ptr<ProcessingGraph> graph(new ProcessingGraph(args.graphFileName));
+		if (graph->bgBlurSize() > 0 && graph->bgBlurSize() != args.blurSize)
+			throw runtime_error("The processing graph blurs with " + to_string(graph->bgBlurSize()) + " before bgdiff, the background with -b " + to_string(args.blurSize) + ", make them the same");
+		verbose("Processing graph:\n" + graph->plan());
+		kmt.setGraph(move(graph));
+	}
+}
+
+// Arena tracked alongside others in the same frame
+struct arenaState {
+	ArenaConfig config;
+	Rect region; // In the cropped frame
+	unique_ptr<Kmt> pKmt;
+	dataOutput dataOut;
+	Overlay marked;
+	int loggedThreshold = -1;
+};
+
+/**
+ * Logs the automatic threshold with the time, when it changed.
+ *
+ * args: kmt
+ *		 logged: last logged threshold, updated
+ *		 t: time (ms)
+ *		 name: of the arena, empty for none
+ */
+void logThreshold(const Kmt& kmt, int& logged, unsigned int t, string name) {
+	int threshold = kmt.currentThreshold();
+	if (threshold == logged) return;
+	logged = threshold;
+	cout << "[" << t << " ms] " << (name.empty() ? "" : name + ": ") << "threshold " << threshold << "               " << endl;
+}
+
 /**
  * Runs kmt with the given arguments.
  *
  */
-void kmt(bool colorMode, bool rawMode, int blurSize, int thresholdValue, float minimumSize, bool triggerMode, bool overwrite, bool streamOutput, bool videoOutput, string dataFileName, string videoFileName, int fps) {	
+void kmt(kmtArgs args) {
 	// Init kmt
 	unique_ptr<Kmt> pKmt;
+	bool replaying = !args.replayFileName.empty();
 	try {
-		pKmt.reset(new Kmt());
+		pKmt.reset(replaying ? new Kmt(nullptr) : new Kmt());
 	} catch (NoDefaultKinectException) {
 		cerr << "Default kinect was either not found or doesn't return depth stream" << endl;
 		exit(1);
 	}
+	if (replaying) pKmt->enableReplay(args.replayFileName);
 
-	// Get mat source pointer
-	Mat(Kmt::*source)();
-	if (colorMode)
-		source = &Kmt::getColorMat;
-	else
-		source = &Kmt::getDepthMat;
+	// Get mat source
+	bool floorMode = !args.rawMode && args.floorHeight > 0;
+	SourceKind source = args.colorMode ? colorSource : floorMode ? rawDepthSource : depthSource;
 
-	// Set bg file
-	if (!rawMode) {
-		Mat bg;
-		bg = imread("./bg.bmp", IMREAD_GRAYSCALE);
-		if (bg.data != nullptr) {
-			pKmt->setBg(bg);
+	if (args.archiveCheckFrames > 0) {
+		checkArchive(*pKmt, args.archiveCheckFrames);
+		return;
+	}
+
+	// Init arenas, only the region containing all of them is converted
+	bool arenaMode = !args.rawMode && !args.arenaFileName.empty();
+	if (!arenaMode && args.crop.area() > 0) {
+		Rect crop = args.colorMode ? pKmt->setColorCrop(args.crop) : pKmt->setDepthCrop(args.crop);
+		verbose("Crop " + to_string(crop.width) + "x" + to_string(crop.height) + " at " + to_string(crop.x) + "," + to_string(crop.y));
+	}
+	vector<arenaState> arenas;
+	unique_ptr<ThreadPool> pool;
+	Rect crop;
+	if (arenaMode) {
+		vector<ArenaConfig> configs = loadArenaConfig(args.arenaFileName, args.thresholdValue);
+		Rect bounds = arenaBounds(configs);
+		crop = args.colorMode ? pKmt->setColorCrop(bounds) : pKmt->setDepthCrop(bounds);
+
+		arenas.resize(configs.size());
+		for (int i = 0; i < configs.size(); i++) {
+			arenaState& arena = arenas[i];
+			arena.config = configs[i];
+			arena.region = (configs[i].region & crop) - crop.tl();
+			if (arena.region.area() == 0)
+				throw runtime_error("Arena \"" + configs[i].name + "\" lies outside of the sensor frame");
+			arena.pKmt.reset(new Kmt(nullptr));
+			initTracking(*arena.pKmt, args);
 		}
-		else {
-			cout << "bg.bmp not found, press enter to capture..." << endl;
+
+		pool.reset(new ThreadPool(min((int)arenas.size(), (int)thread::hardware_concurrency()) - 1));
+		verbose("Tracking " + to_string(arenas.size()) + " arenas");
+	} else if (!args.rawMode) {
+		initTracking(*pKmt, args);
+	}
+
+	// Set floor model, replaces the background
+	if (floorMode) {
+		Mat expected = loadBg("./floor.png", [&]() {
+			cout << "Floor model not found, press enter to learn it..." << endl;
 			cin.get();
-			bg = pKmt->blur((*pKmt.*source)(), blurSize);
-			imwrite("./bg.bmp", bg);
+			return learnFloor(*pKmt, 30, args.walls);
+		}, IMREAD_UNCHANGED);
+		if (expected.size() != pKmt->getDepthCrop().size() || expected.type() != CV_16U)
+			throw runtime_error("Floor model \"./floor.png\" doesn't match the cropped depth frame, delete it to learn the floor again");
+		FloorModel floor(expected);
+		Mat limit = floor.limit(args.floorHeight);
+
+		if (arenaMode) {
+			for (arenaState& arena : arenas)
+				arena.pKmt->setFloorLimit(limit(arena.region).clone());
+		} else {
+			pKmt->setFloorLimit(limit);
+		}
+	}
+
+	// Set bg file(s)
+	bool fillHoles = args.fillHoles && !args.rawMode && !floorMode;
+	if (fillHoles) pKmt->enableHoleFilling(); // From the neighbours until there is a background
+	if (!args.rawMode && !floorMode) {
+		Mat captured, capturedSd;
+		auto captureSd = [&]() {
+			if (capturedSd.empty()) {
+				int frames = args.medianFrames > 0 ? args.medianFrames : 100;
+				cout << "Background noise not found, press enter to learn it from " << frames << " frames..." << endl;
+				cin.get();
+				unique_ptr<BackgroundStats> stats = learnBgStats(*pKmt, source, frames, args);
+				capturedSd = stats->sd();
+				if (captured.empty()) captured = stats->mean();
+			}
+			return capturedSd;
+		};
+		auto captureBg = [&]() {
+			if (captured.empty() && args.sigmas > 0) {
+				captureSd(); // Background is the mean of the noise frames
+			} else if (captured.empty()) {
+				cout << "Background not found, press enter to capture..." << endl;
+				cin.get();
+				Mat raw;
+				if (args.medianFrames > 0)
+					raw = learnMedianBg(*pKmt, source, args.medianFrames);
+				else if (args.denoiseFrames > 0)
+					raw = learnDenoisedBg(*pKmt, source, args.denoiseFrames); // Filtered like the tracked frames
+				else
+					raw = capture(*pKmt, source);
+				captured = pKmt->blur(raw, args.blurSize);
+			}
+			return captured;
+		};
+
+		if (arenaMode) {
+			// The frame is converted once for all arenas: holes in an arena get its background, only its inside is converted
+			Mat fill = Mat::zeros(crop.size(), CV_8U);
+			Mat inside = Mat::zeros(crop.size(), CV_8U);
+			for (arenaState& arena : arenas) {
+				Mat bg = loadBg(arena.config.bgFileName, [&]() { return captureBg()(arena.region).clone(); });
+				arena.pKmt->setBg(bg);
+				bg.copyTo(fill(arena.region));
+				if (args.detectArena) {
+					Mat mask = loadArenaMask(arena.config.bgFileName, bg);
+					arena.pKmt->setArenaMask(mask);
+					mask.copyTo(inside(arena.region));
+				}
+				if (args.sigmas > 0) {
+					Mat sd = loadBg(bgSdFileName(arena.config.bgFileName), [&]() { return captureSd()(arena.region).clone(); }, IMREAD_UNCHANGED);
+					arena.pKmt->setBgNoise(sd, args.sigmas, args.thresholdValue);
+				}
+			}
+			if (fillHoles) pKmt->enableHoleFilling(fill);
+			if (args.detectArena) pKmt->setArenaMask(inside, fill);
+		} else {
+			Mat bg = loadBg("./bg.bmp", captureBg);
 			pKmt->setBg(bg);
-			cout << "bg.bmp saved" << endl;
+			if (args.sigmas > 0)
+				pKmt->setBgNoise(loadBg(bgSdFileName("./bg.bmp"), captureSd, IMREAD_UNCHANGED), args.sigmas, args.thresholdValue);
+			if (fillHoles) pKmt->enableHoleFilling(bg);
+			if (args.detectArena) pKmt->setArenaMask(loadArenaMask("./bg.bmp", bg), bg);
+
+			if (args.benchmarkFrames > 0) {
+				benchmarkPipeline(*pKmt, source, bg, args);
+				return;
+			}
+		}
+
+		if (args.learningShift > 0) {
+			if (arenaMode) {
+				for (arenaState& arena : arenas)
+					arena.pKmt->enableAdaptiveBg(args.blurSize, arena.config.thresholdValue, args.learningShift);
+			} else {
+				pKmt->enableAdaptiveBg(args.blurSize, args.thresholdValue, args.learningShift);
+			}
+		}
+
+		if (args.autoThreshold) {
+			if (arenaMode) {
+				for (arenaState& arena : arenas)
+					arena.pKmt->enableAutoThreshold(arena.config.thresholdValue);
+			} else {
+				pKmt->enableAutoThreshold(args.thresholdValue);
+			}
 		}
 	}
 
-	// Inititalise data file
-	ofstream dataOut;
-	if (!rawMode) {
-		if (!overwrite && fileExists(dataFileName)) {
-			cerr << "Data file \"" << dataFileName << "\" already exists, choose another name using the -d option" << endl;
+	// Inititalise data file(s)
+	dataOutput dataOut;
+	if (arenaMode) {
+		for (arenaState& arena : arenas)
+			initDataFile(arena.dataOut, arena.config.dataFileName, args);
+	} else if (!args.rawMode) {
+		initDataFile(dataOut, args.dataFileName, args);
+	}
+
+	// Inititalise video
+	if (args.videoOutput) {
+		if (!args.overwrite && fileExists(args.videoFileName)) {
+			cerr << "Video file \"" << args.videoFileName << "\" already exists, choose another name using the -v option" << endl;
 			exit(1);
 		}
-		dataOut.open(dataFileName);
-		dataOut << "t (ms),x (px),y (px)\n";
+		// Get test frame, tracked frames are marked in color
+		Mat frame = capture(*pKmt, source);
+		pVideo.reset(new AsyncVideoWriter(args.videoFileName, CV_FOURCC('M', 'J', 'P', 'G'), args.fps, Size(frame.cols, frame.rows), args.rawMode ? frame.type() : CV_8UC3, args.videoQueue, args.videoPolicy,
+			args.videoFileName.substr(0, args.videoFileName.rfind('.')) + "_index.csv"));
 	}
 
-	// Inititalise video
-	if (videoOutput) {
-		if (!overwrite && fileExists(videoFileName)) {
-			cerr << "Video file \"" << videoFileName << "\" already exists, choose another name using the -v option" << endl;
+	// Initialise animal centred video
+	unique_ptr<AsyncVideoWriter> followVideo;
+	unique_ptr<FollowCrop> follow;
+	if (args.followSize > 0) {
+		if (!args.overwrite && fileExists(args.followFileName)) {
+			cerr << "Video file \"" << args.followFileName << "\" already exists, choose another name using the --followfile option" << endl;
 			exit(1);
 		}
-		// Get test frame
-		Mat frame = (*pKmt.*source)();
-		pVideo.reset(new VideoWriter(videoFileName, CV_FOURCC('M', 'J', 'P', 'G'), fps, Size(frame.cols, frame.rows)));
+		Mat frame = capture(*pKmt, source);
+		follow.reset(new FollowCrop(frame.size(), args.followSize));
+		followVideo.reset(new AsyncVideoWriter(args.followFileName, CV_FOURCC('M', 'J', 'P', 'G'), args.fps, follow->size(), frame.type(), args.videoQueue, args.videoPolicy,
+			args.followFileName.substr(0, args.followFileName.rfind('.')) + "_index.csv"));
 	}
 
-	// Initialise stream
-	const char* streamWindowName = "kmt stream";
-	if (streamOutput) {
-		namedWindow(streamWindowName, WINDOW_AUTOSIZE);
+	// Initialise raw depth archive
+	unique_ptr<DepthArchiveWriter> archive;
+	if (!args.archiveFileName.empty()) {
+		if (!args.overwrite && fileExists(args.archiveFileName)) {
+			cerr << "Archive file \"" << args.archiveFileName << "\" already exists, choose another name using the --archive option" << endl;
+			exit(1);
+		}
+		archive.reset(new DepthArchiveWriter(args.archiveFileName, pKmt->getDepthCrop()));
 	}
 
+	// Initialise stream, the window is owned by the preview's thread
+	unique_ptr<Preview> preview;
+	if (args.streamOutput)
+		preview.reset(new Preview("kmt stream", args.previewFps, args.previewScale));
+
+	// Initialise temporal filter
+	unique_ptr<TemporalFilter> denoise;
+	if (args.denoiseFrames > 0 && !args.rawMode)
+		denoise.reset(new TemporalFilter(args.denoiseFrames));
+
 	// Wait for trigger
-	if (triggerMode) {
+	if (args.triggerMode) {
 		cout << "Trigger mode active, press enter to start..." << endl;
 		cin.get();
 	}
@@ -225,13 +988,37 @@ void kmt(bool colorMode, bool rawMode, int blurSize, int thresholdValue, float m
 	// Stream
 	verbose("Starting stream...");
 	unsigned int t;
+	unsigned int row = 0; // Data row of the frame, 0 is the first (all zero) row
+	int loggedThreshold = -1;
 	chrono::time_point<Time> tStart, tFrameStart, tFrameCap, tFrameEnd;
 	tStart = Time::now();
-	if (!rawMode) {
-		dataOut << "0,0,0\n";
+	vector<double> firstRow = { 0 };
+	for (int i = 0; i < args.animals; i++) {
+		firstRow.insert(firstRow.end(), { 0, 0 });
+		if (args.orientationOutput)
+			firstRow.insert(firstRow.end(), { 0, 1, 0 });
+	}
+	if (arenaMode) {
+		for (arenaState& arena : arenas) {
+			arena.dataOut.row = firstRow;
+			writeDataRow(arena.dataOut);
+		}
+	} else if (!args.rawMode) {
+		dataOut.row = firstRow;
+		writeDataRow(dataOut);
 	}
-	while (true) {
-		if (waitKey(1) >= 0) {
+	// Stop on enter, the thread stays blocked on stdin until kmt exits. Without a stdin (EOF, e.g. run as a service) only ctrl+c stops
+	thread([]() {
+		while (cin.get() != '\n') {
+			if (!cin) return;
+		}
+		stopRequested = true;
+	}).detach();
+	cout << "Press enter" << (preview ? " (or any key in the stream window)" : "") << " to stop" << endl;
+
+	streaming = true;
+	while (!stopRequested) {
+		if (preview && preview->keyPressed()) {
 			break;
 		}
 
@@ -240,43 +1027,113 @@ void kmt(bool colorMode, bool rawMode, int blurSize, int thresholdValue, float m
 		// Fetch frame
 		Mat frame;
 		try {
-			frame = (*pKmt.*source)();
+			frame = capture(*pKmt, source);
 		} catch (NoFrameException) {
 			cout << "Skipping frame..." << endl;
 			continue;
+		} catch (EndOfReplayException) {
+			break;
 		}
 
-		// Calc time of capture
+		// Calc time of capture, replayed frames keep theirs
 		tFrameCap = Time::now();
-		t = toMs(tFrameCap - tStart);
-
-		// Process
-		findPosOutput posOutput;
-		if (!rawMode) {
-			Mat processed = pKmt->diffThreshold(pKmt->blur(frame, blurSize), thresholdValue);
-			posOutput = pKmt->findPos(processed, minimumSize);
-			frame = posOutput.frame;
+		t = replaying ? pKmt->replayTime() : toMs(tFrameCap - tStart);
+		row++;
+
+		// Archive before anything changes the frame
+		if (archive) archive->write(pKmt->lastRawDepthMat(), t);
+
+		// Process, the frame shown and encoded is only drawn by the outputs that exist
+		if (denoise) frame = denoise->apply(frame);
+		function<void(Mat&)> render = [frame](Mat& out) { frame.copyTo(out); };
+		if (arenaMode) {
+			pool->parallelFor((int)arenas.size(), [&](int i) {
+				arenaState& arena = arenas[i];
+				arena.marked = track(*arena.pKmt, frame(arena.region), t, arena.config.thresholdValue, args, arena.dataOut);
+			});
+
+			vector<pair<Rect, Overlay>> marked;
+			for (arenaState& arena : arenas)
+				marked.push_back({ arena.region, arena.marked });
+			Size size = frame.size();
+			render = [marked, size](Mat& out) {
+				out.create(size, CV_8UC3);
+				out.setTo(Scalar::all(0));
+				for (const pair<Rect, Overlay>& arena : marked) {
+					Mat region = out(arena.first);
+					arena.second.render(region);
+				}
+			};
+		} else if (!args.rawMode) {
+			Overlay marked = track(*pKmt, frame, t, args.thresholdValue, args, dataOut);
+			render = [marked](Mat& out) { marked.render(out); };
+			if (follow) {
+				Rect window = follow->update(Point2f((float)dataOut.row[1], (float)dataOut.row[2]));
+				followVideo->write(frame(window), t, row);
+			}
+		}
+
+		if (args.autoThreshold) {
+			if (arenaMode) {
+				for (arenaState& arena : arenas)
+					logThreshold(*arena.pKmt, arena.loggedThreshold, t, arena.config.name);
+			} else if (!args.rawMode) {
+				logThreshold(*pKmt, loggedThreshold, t, "");
+			}
 		}
 
 		// Output
-		if (streamOutput) imshow(streamWindowName, frame);
-		if (videoOutput) pVideo->write(frame);
-		if (!rawMode) dataOut << t << "," << posOutput.x << "," << posOutput.y << "\n";
+		if (preview) preview->publish(render);
+		if (args.videoOutput) pVideo->write(render, t, row);
 
 		// Print fps
 		tFrameEnd = Time::now();
 		unsigned int frameTime = toMs(tFrameEnd - tFrameStart);
-		int fps = 1000 / frameTime;
-		cout << "fps: " << fps << "               " << '\r' << flush;
+		int fps = 1000 / (std::max)(frameTime, 1u);
+		cout << "fps: " << fps;
+		if (args.videoOutput) cout << ", video queue: " << pVideo->stats().depth;
+		cout << "               " << '\r' << flush;
 	}
+
+	// Compress what is still queued
+	if (archive) {
+		archive->close();
+		cout << endl << "Archive: " << fixed << setprecision(1) << archive->bytesWritten() / 1e6 << " MB" << endl;
+	}
+
+	if (preview) preview->close();
+	if (followVideo) followVideo->close();
+
+	// Encode what is still queued
+	if (args.videoOutput) {
+		pVideo->close();
+		VideoStats video = pVideo->stats();
+		cout << endl << "Video: " << video.frames << " frames (" << video.repeated << " repeated, " << video.skipped << " skipped), latency " << fixed << setprecision(1)
+			<< video.meanLatency << " ms (max " << video.maxLatency << " ms), queue max " << video.maxDepth << ", dropped " << video.dropped << ", spilled " << video.spilled << endl;
+	}
+
+	// The data files are closed with their outputs
+	streaming = false;
+	dataOutputs.clear();
+	if (stopRequested) cout << endl << "Exiting..." << endl;
 }
 
 void signalHandler(int signum) {
+	// The stream loop finishes its frame and closes the files itself
+	if (streaming) {
+		stopRequested = true;
+		signal(SIGINT, signalHandler);
+		return;
+	}
+
 	cout << "Exiting..." << endl;
 
 	if (pVideo != nullptr) {
 		pVideo.release();
 	}
 
+	for (dataOutput* dataOut : dataOutputs)
+		closeDataFile(*dataOut);
+
 	exit(0);
 }